@@ -0,0 +1,19 @@
+#!/bin/sh
+#
+# file:        precompress.sh
+# description: build the .gz (and, if brotli is installed, .br) sidecars
+#              that server.c serves to clients sending Accept-Encoding.
+#              Re-run after changing a file - stale sidecars are ignored.
+#
+# usage: ./precompress.sh [dir]
+#
+cd "${1:-.}" || exit 1
+for f in *.html *.htm *.txt *.css *.js *.json *.svg *.xml; do
+    [ -f "$f" ] || continue
+    gzip -9 -k -f -n "$f"
+    touch -r "$f" "$f.gz"
+    if command -v brotli > /dev/null; then
+        brotli -q 11 -k -f "$f"
+        touch -r "$f" "$f.br"
+    fi
+done
@@ -14,6 +14,8 @@
 #include <sys/time.h>
 #include <fcntl.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <errno.h>
 #include "qthread.h"
 
@@ -22,6 +24,13 @@ qthread_t current;         // current stack pointer.
 struct tqueue active;      // active thread queue.
 struct tqueue sleepers;    // sleeping thread queue.
 struct tqueue io_waiters;  // queue of threads waiting for I/O.
+int nthreads;              // number of threads that haven't exited.
+bool embedded;             // inside qthread_poll_once - never block.
+int epfd = -1;             // epoll fd handed out by qthread_poll_fd.
+struct fd_info *fd_info;   // I/O waiters on each fd, see fd_get().
+int fd_info_len;
+bool vclock = QTHREAD_VCLOCK; // virtual clock mode.
+long long vnow;            // virtual time of now, in usecs.
 
 /* prototypes for stack.c and switch.s */
 extern void switch_to(void **location_for_old_sp, void *new_value);
@@ -39,6 +48,7 @@ struct qthread {
     bool      done;   // done flag
     io_status status; // io status
     int       fd;     // file descriptor
+    long long wakeup; // wake-up time of a sleeping thread
 }; 
 
 /**
@@ -89,10 +99,145 @@ static bool tq_empty(tqueue_t tq) {
 }
 
 /**
- * Wait mathod for I/O
+ * Tell time of now on the real clock.
  */
-static void io_wait() {
+static long long real_usecs(void){
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/**
+ * Tell time of now.
+ */
+static long long get_usecs(void){
+    if (vclock) {
+        if (vnow == 0) {
+            vnow = real_usecs();
+        }
+        return vnow;
+    }
+    return real_usecs();
+}
+
+/**
+ * Time until the earliest sleeper is due.
+ *
+ * @return usecs to wait, 0 if one is already due, -1 if none sleeps.
+ */
+static long long next_timeout(void) {
+    if (tq_empty(&sleepers)) {
+        return -1;
+    }
+    long long earliest = sleepers.head->wakeup;
+    qthread_t curr;
+    for (curr = sleepers.head->next; curr != NULL; curr = curr->next) {
+        if (curr->wakeup < earliest) {
+            earliest = curr->wakeup;
+        }
+    }
+    long long usecs = earliest - get_usecs();
+    return usecs > 0 ? usecs : 0;
+}
+
+/**
+ * Move every sleeper that is due back to the active queue.
+ */
+static void wake_sleepers(void) {
+    struct tqueue tmp = {NULL, NULL};
+    long long now = get_usecs();
+    while (!tq_empty(&sleepers)) {
+        qthread_t curr = tq_pop(&sleepers);
+        if (curr->wakeup <= now) {
+            tq_append(&active, curr);
+        } else {
+            tq_append(&tmp, curr);
+        }
+    }
+    sleepers = tmp;
+}
+
+/**
+ * Per-descriptor state for the epoll set. Grown as needed, so unlike
+ * select() it has no FD_SETSIZE limit.
+ */
+struct fd_info {
+    int readers;   // threads waiting to read the fd
+    int writers;   // threads waiting to write the fd
+    int ep_events; // events registered on epfd for the fd
+    int ready;     // events epoll_wait just reported, see ep_wake()
+};
+
+/**
+ * Get the state for a descriptor, growing the table to fit it.
+ *
+ * @param fd file descriptor
+ * @return the fd's entry
+ */
+static struct fd_info *fd_get(int fd) {
+    if (fd >= fd_info_len) {
+        int len = fd_info_len ? fd_info_len : 64;
+        while (len <= fd) {
+            len *= 2;
+        }
+        fd_info = realloc(fd_info, len * sizeof(*fd_info));
+        assert(fd_info != NULL);
+        memset(fd_info + fd_info_len, 0, (len - fd_info_len) * sizeof(*fd_info));
+        fd_info_len = len;
+    }
+    return &fd_info[fd];
+}
+
+/**
+ * Bring fd's registration on the epoll set in line with the threads
+ * waiting on it. Called only when a thread starts or stops waiting,
+ * and only touches the epoll set if the wanted events changed.
+ *
+ * @param fd file descriptor
+ */
+static void ep_update(int fd) {
+    struct fd_info *fi = fd_get(fd);
+    int want = (fi->readers ? EPOLLIN : 0) | (fi->writers ? EPOLLOUT : 0);
+    struct epoll_event ev = {.events = want, .data.fd = fd};
+    if (epfd == -1 || want == fi->ep_events) {
+        return;
+    }
+    if (want == 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    } else if (fi->ep_events == 0 ||
+               (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == -1 && errno == ENOENT)) {
+        // not registered, or closed (which drops it) since we added it
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    fi->ep_events = want;
+}
+
+/**
+ * Note that a thread has started (delta 1) or stopped (delta -1)
+ * waiting for I/O on its fd.
+ *
+ * @param qt the thread
+ * @param delta 1 or -1
+ */
+static void io_count(qthread_t qt, int delta) {
+    if (qt->status == write_mode) {
+        fd_get(qt->fd)->writers += delta;
+    } else {
+        fd_get(qt->fd)->readers += delta;
+    }
+    ep_update(qt->fd);
+}
+
+/**
+ * Wait method for I/O - select() on every descriptor a thread is
+ * waiting for, and move the threads that can proceed to the active
+ * queue.
+ *
+ * @param usecs longest time to block, or -1 to block until I/O
+ */
+static void io_wait(long long usecs) {
     fd_set rfds, wfds;
+    int maxfd = -1;
     FD_ZERO(&rfds);
     FD_ZERO(&wfds);
     qthread_t curr = io_waiters.head;
@@ -102,30 +247,89 @@ static void io_wait() {
         } else if (curr->status == read_mode) {
             FD_SET(curr->fd, &rfds);
         }
+        if (curr->fd > maxfd) {
+            maxfd = curr->fd;
+        }
         curr = curr->next;
     }
     struct timeval tv = {
-        .tv_sec = 0,
-        .tv_usec = PEND_TIME
+        .tv_sec = usecs / 1000000,
+        .tv_usec = usecs % 1000000
     };
-    select(FD_SETSIZE, &rfds, &wfds, NULL, &tv);
-    struct tqueue tmp;
+    if (select(maxfd + 1, &rfds, &wfds, NULL, usecs < 0 ? NULL : &tv) <= 0) {
+        return;
+    }
+    struct tqueue tmp = {NULL, NULL};
     while (!tq_empty(&io_waiters)) {
         qthread_t curr = tq_pop(&io_waiters);
         if (FD_ISSET(curr->fd, &rfds) || FD_ISSET(curr->fd, &wfds)) {
+            io_count(curr, -1);
             tq_append(&active, curr);
         } else {
             tq_append(&tmp, curr);
         }
     }
-    while (!tq_empty(&tmp)) {
-        tq_append(&io_waiters, tq_pop(&tmp));
+    io_waiters = tmp;
+}
+
+/**
+ * Wait method for I/O once the host has the epoll fd: take the events
+ * that are ready without blocking (the host has already waited on
+ * epfd) and move the threads that can proceed to the active queue.
+ */
+static void ep_wake(void) {
+    struct epoll_event evs[64];
+    int n, i;
+    do {
+        n = epoll_wait(epfd, evs, 64, 0);
+        if (n <= 0) {
+            return;
+        }
+        for (i = 0; i < n; i++) {
+            fd_get(evs[i].data.fd)->ready = evs[i].events;
+        }
+        struct tqueue tmp = {NULL, NULL};
+        while (!tq_empty(&io_waiters)) {
+            qthread_t curr = tq_pop(&io_waiters);
+            int ready = fd_info[curr->fd].ready;
+            if ((ready & (EPOLLERR | EPOLLHUP)) ||
+                (ready & (curr->status == write_mode ? EPOLLOUT : EPOLLIN))) {
+                io_count(curr, -1);
+                tq_append(&active, curr);
+            } else {
+                tq_append(&tmp, curr);
+            }
+        }
+        io_waiters = tmp;
+        for (i = 0; i < n; i++) {
+            fd_info[evs[i].data.fd].ready = 0;
+        }
+    } while (n == 64);
+}
+
+/**
+ * Nothing is runnable under the virtual clock: take whatever I/O is
+ * ready right now, and if there is none jump to the earliest sleeper's
+ * deadline. Only block for real when no thread sleeps at all.
+ */
+static void vclock_wait(void) {
+    if (!tq_empty(&io_waiters)) {
+        io_wait(tq_empty(&sleepers) ? -1 : 0);
+    }
+    if (tq_empty(&active) && !tq_empty(&sleepers)) {
+        vnow += next_timeout();
+        wake_sleepers();
     }
 }
 
 /**
  * Schedule current active thread.
  *
+ * When nothing is runnable the scheduler blocks in select() until the
+ * earliest sleeper is due or a descriptor becomes ready. When every
+ * thread has exited - or, under qthread_poll_once, as soon as nothing
+ * is runnable - it switches back to the main stack instead.
+ *
  * @param save_location previous stack pointer to save.
  */
 static void schedule(void *save_location) {
@@ -136,33 +340,21 @@ again:
         return;
     }
     if (current == NULL) {
-        if (tq_empty(&sleepers) && tq_empty(&io_waiters)) {
-            switch_to(NULL, main_stack);
-        } 
-        if (!tq_empty(&sleepers)) {
-            usleep(PEND_TIME);
-            while (!tq_empty(&sleepers)) {
-                tq_append(&active, tq_pop(&sleepers));
-            }
-            goto again;
-        } 
-        if (!tq_empty(&io_waiters)) {
-            io_wait();
+        if (embedded || (tq_empty(&sleepers) && tq_empty(&io_waiters))) {
+            switch_to(save_location, main_stack);
+            return;
+        }
+        if (vclock) {
+            vclock_wait();
             goto again;
-        } 
+        }
+        io_wait(next_timeout());
+        wake_sleepers();
+        goto again;
     }
     switch_to(save_location, current->sp);
 }
 
-/**
- * Tell time of now.
- */
-static unsigned get_usecs(void){
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return tv.tv_sec * 1000000 + tv.tv_usec;
-}
-
 /**
  * Jump function for qthread_create to qthread_exit and return exit value.
  *
@@ -191,6 +383,8 @@ qthread_t qthread_start(f_2arg_t f, void *arg1, void *arg2){
     qt->done     = false;
     qt->status   = no_io;
     qt->fd       = -1;
+    qt->wakeup   = 0;
+    nthreads++;
     tq_append(&active, qt);
     return qt;
 }
@@ -213,6 +407,61 @@ void qthread_run(void) {
     schedule(&main_stack);
 }
 
+/**
+ * Run every runnable thread until all of them are sleeping, waiting
+ * for I/O or done, then return without blocking.
+ *
+ * @return number of threads that haven't exited yet.
+ */
+int qthread_poll_once(void) {
+    if (epfd != -1) {
+        ep_wake();
+    } else if (!tq_empty(&io_waiters)) {
+        io_wait(0);
+    }
+    if (vclock && tq_empty(&active) && !tq_empty(&sleepers)) {
+        vnow += next_timeout();
+    }
+    wake_sleepers();
+    embedded = true;
+    schedule(&main_stack);
+    embedded = false;
+    return nthreads;
+}
+
+/**
+ * Get the descriptor to wait on between calls to qthread_poll_once.
+ *
+ * @return epoll fd, readable when a thread waiting for I/O can proceed.
+ */
+int qthread_poll_fd(void) {
+    qthread_t curr;
+    if (epfd == -1) {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        for (curr = io_waiters.head; curr != NULL; curr = curr->next) {
+            ep_update(curr->fd);
+        }
+    }
+    return epfd;
+}
+
+/**
+ * Get the longest time the host may wait before the next
+ * qthread_poll_once.
+ *
+ * @return usecs until the earliest sleeper is due, 0 if a thread is
+ *         runnable, or -1 if only I/O can wake a thread.
+ */
+long qthread_poll_timeout(void) {
+    if (!tq_empty(&active)) {
+        return 0;
+    }
+    if (vclock && !tq_empty(&sleepers)) {
+        return 0;               // next poll jumps to the deadline
+    }
+    return next_timeout();
+}
+
 /**
  * Yield to the next runnable thread.
  */
@@ -230,6 +479,7 @@ void qthread_exit(void *val){
     qthread_t qt = current;
     qt->retval = val;
     qt->done = true;
+    nthreads--;
     if (qt->waiter) {
         tq_append(&active, qt->waiter);
         qt->waiter = NULL;
@@ -262,13 +512,43 @@ void *qthread_join(qthread_t qt){
  * @param usecs time to sleep
  */
 void qthread_usleep(long int usecs){
-    unsigned wakeup = get_usecs() + usecs;
-    while (get_usecs() < wakeup) {
+    current->wakeup = get_usecs() + usecs;
+    while (get_usecs() < current->wakeup) {
         tq_append(&sleepers, current);
         schedule(&current->sp);
     }
 }
 
+/**
+ * Switch the qthread clock between real and virtual time.
+ *
+ * @param on true for virtual time, false for real time
+ */
+void qthread_set_vclock(bool on){
+    if (on && !vclock) {
+        vnow = real_usecs();
+    }
+    vclock = on;
+}
+
+/**
+ * Tell time of now on the qthread clock (real or virtual).
+ *
+ * @return usecs since the epoch
+ */
+long long qthread_get_usecs(void){
+    return get_usecs();
+}
+
+/**
+ * Get the running thread.
+ *
+ * @return current thread, or NULL outside of any qthread.
+ */
+qthread_t qthread_self(void){
+    return current;
+}
+
 /**
  * Initiate the mutex.
  *
@@ -369,6 +649,33 @@ void qthread_cond_broadcast(qthread_cond_t *cond){
 
 // I/O related functions
 
+/**
+ * Put the file descriptor in non-blocking mode.
+ *
+ * @param fd file descriptor
+ */
+static void set_nonblock(int fd) {
+    int tmp = fcntl(fd, F_GETFL, 0);
+    if (tmp != -1 && !(tmp & O_NONBLOCK)) {
+        fcntl(fd, F_SETFL, tmp | O_NONBLOCK);
+    }
+}
+
+/**
+ * Park the current thread until the scheduler's select() reports
+ * that fd is ready for the given mode.
+ *
+ * @param fd file descriptor
+ * @param status read_mode or write_mode
+ */
+void qthread_wait_fd(int fd, io_status status){
+    current->status = status;
+    current->fd = fd;
+    io_count(current, 1);
+    tq_append(&io_waiters, current);
+    schedule(&current->sp);
+}
+
 /**
  * Thread read function.
  *
@@ -389,14 +696,10 @@ void qthread_cond_broadcast(qthread_cond_t *cond){
  * @return length of actual reading.
  */
 ssize_t qthread_read(int fd, void *buf, size_t len){
-    // set non-blocking mode every time. 
-    int val, tmp = fcntl(fd, F_GETFL, 0);
-    fcntl(fd, F_SETFL, tmp | O_NONBLOCK);
-    current->status = read_mode;
-    current->fd = fd;
+    ssize_t val;
+    set_nonblock(fd);
     while ((val = read(fd, buf, len)) == -1 && errno == EAGAIN) {
-        tq_append(&io_waiters, current);
-        schedule(&current->sp);
+        qthread_wait_fd(fd, read_mode);
     }
     return val;
 }
@@ -411,7 +714,12 @@ ssize_t qthread_read(int fd, void *buf, size_t len){
  * @return length of receiving size.
  */
 ssize_t qthread_recv(int sockfd, void *buf, size_t len, int flags){
-    return qthread_read(sockfd, buf, len);
+    ssize_t val;
+    set_nonblock(sockfd);
+    while ((val = recv(sockfd, buf, len, flags)) == -1 && errno == EAGAIN) {
+        qthread_wait_fd(sockfd, read_mode);
+    }
+    return val;
 }
 
 /* like read - make sure the descriptor is in non-blocking mode, check
@@ -420,17 +728,44 @@ ssize_t qthread_recv(int sockfd, void *buf, size_t len, int flags){
  * for the select call.
  */
 int qthread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen){
-    int val, tmp = fcntl(fd, F_GETFL, 0);
-    fcntl(fd, F_SETFL, tmp | O_NONBLOCK);
-    current->status = read_mode;
-    current->fd = fd;
+    int val;
+    set_nonblock(fd);
     while ((val = accept(fd, addr, addrlen)) == -1 && errno == EAGAIN) {
-        tq_append(&io_waiters, current);
-        schedule(&current->sp);
+        qthread_wait_fd(fd, read_mode);
     }
     return val;
 }
 
+/**
+ * Thread connect function for socket.
+ *
+ * @param fd socket
+ * @param addr address to connect to
+ * @param addrlen length of address
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int qthread_connect(int fd, const struct sockaddr *addr, socklen_t addrlen){
+    int err;
+    socklen_t len = sizeof(err);
+    set_nonblock(fd);
+    if (connect(fd, addr, addrlen) == 0) {
+        return 0;
+    }
+    if (errno != EINPROGRESS) {
+        return -1;
+    }
+    // writable means the handshake has finished, one way or the other
+    qthread_wait_fd(fd, write_mode);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+        return -1;
+    }
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * Thread write function.
  *
@@ -444,13 +779,10 @@ int qthread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen){
 * @return length of actual writing.
  */
 ssize_t qthread_write(int fd, void *buf, size_t len){
-    int val, tmp = fcntl(fd, F_GETFL, 0);
-    fcntl(fd, F_SETFL, tmp | O_NONBLOCK);
-    current->status = write_mode;
-    current->fd = fd;
+    ssize_t val;
+    set_nonblock(fd);
     while ((val = write(fd, buf, len)) == -1 && errno == EAGAIN) {
-        tq_append(&io_waiters, current);
-        schedule(&current->sp);
+        qthread_wait_fd(fd, write_mode);
     }
     return val;
 }
@@ -465,5 +797,29 @@ ssize_t qthread_write(int fd, void *buf, size_t len){
  * @return length of sending size.
  */
 ssize_t qthread_send(int fd, void *buf, size_t len, int flags){
-    return qthread_write(fd, buf, len);
+    ssize_t val;
+    set_nonblock(fd);
+    while ((val = send(fd, buf, len, flags)) == -1 && errno == EAGAIN) {
+        qthread_wait_fd(fd, write_mode);
+    }
+    return val;
+}
+
+/**
+ * Thread sendfile function.
+ *
+ * @param out_fd socket to send to
+ * @param in_fd file to read from
+ * @param offset file offset to start from, updated past the bytes sent
+ * @param count largest number of bytes to send
+ * @return number of bytes sent, or -1 on error.
+ */
+ssize_t qthread_sendfile(int out_fd, int in_fd, off_t *offset, size_t count){
+    ssize_t val;
+    set_nonblock(out_fd);
+    while ((val = sendfile(out_fd, in_fd, offset, count)) == -1 &&
+           errno == EAGAIN) {
+        qthread_wait_fd(out_fd, write_mode);
+    }
+    return val;
 }
@@ -7,17 +7,22 @@
 #define __QTHREAD_H__
 
 #ifndef STACK_SIZE
-#define STACK_SIZE 8192
+#define STACK_SIZE 65536
 #endif
 
 #ifndef PEND_TIME
 #define PEND_TIME 10000
 #endif
 
+/* start in virtual-clock mode (see qthread_set_vclock) */
+#ifndef QTHREAD_VCLOCK
+#define QTHREAD_VCLOCK 0
+#endif
+
+#include <stdbool.h>
+#include <sys/types.h>
 #include <sys/socket.h>
 
-// boolean value
-typedef enum {false, true} bool;
 // I/O status of thread
 typedef enum {no_io, read_mode, write_mode} io_status; 
 // function pointer which has two arguments
@@ -56,13 +61,51 @@ struct qthread_cond {
 };
 typedef struct qthread_cond qthread_cond_t;
 
-// Qthread functions: qthread_start/create/run/yield/exit/join/usleep
+// Qthread functions: qthread_start/create/run/yield/exit/join/usleep/self
 
 /**
  * Run until the last thread exits
  */
 void qthread_run(void);
 
+/**
+ * Run every runnable thread until all of them are sleeping, waiting
+ * for I/O or done, then return without blocking. This is the
+ * non-owning alternative to qthread_run for programs with their own
+ * event loop:
+ *
+ *     while (qthread_poll_once() > 0) {
+ *         long usecs = qthread_poll_timeout();
+ *         ... wait for qthread_poll_fd() and the host's own fds,
+ *             for at most 'usecs' (forever if -1) ...
+ *     }
+ *
+ * @return number of threads that haven't exited yet.
+ */
+int qthread_poll_once(void);
+
+/**
+ * Get the descriptor to wait on between calls to qthread_poll_once.
+ * It is an epoll fd which becomes readable when a thread waiting in
+ * qthread_read/write/accept/... can proceed; it stays the same for
+ * the life of the process. Once it has been asked for,
+ * qthread_poll_once picks up I/O from it with a non-blocking
+ * epoll_wait instead of select(), so descriptors above FD_SETSIZE
+ * work too.
+ *
+ * @return epoll file descriptor
+ */
+int qthread_poll_fd(void);
+
+/**
+ * Get the longest time the host may wait before calling
+ * qthread_poll_once again.
+ *
+ * @return usecs until the earliest qthread_usleep is due, 0 if a
+ *         thread is runnable, or -1 if only I/O can wake a thread.
+ */
+long qthread_poll_timeout(void);
+
 /**
  * Start a thread of callback function f with two arguments
  * (function passed to qthread_start is not allowed to return)
@@ -112,6 +155,34 @@ void *qthread_join(qthread_t thread);
  */
 void qthread_usleep(long int usecs);
 
+/**
+ * Get the running thread.
+ *
+ * @return current thread, or NULL when called outside of any qthread
+ *         (e.g. from main before or after qthread_run)
+ */
+qthread_t qthread_self(void);
+
+/**
+ * Switch the qthread clock between real and virtual time. With the
+ * virtual clock, time only moves when every thread is sleeping or
+ * blocked: it then jumps straight to the earliest qthread_usleep
+ * deadline, so timing-based code runs instantly and deterministically.
+ * Threads blocked on I/O still wait for real I/O when nobody sleeps.
+ * Best called before any thread is created; the virtual clock starts
+ * from the real time of the switch.
+ *
+ * @param on true for virtual time, false for real time
+ */
+void qthread_set_vclock(bool on);
+
+/**
+ * Tell time of now on the qthread clock (real or virtual).
+ *
+ * @return usecs since the epoch
+ */
+long long qthread_get_usecs(void);
+
 // Mutex functions: qthread_mutex_init/lock/unlock
 
 /**
@@ -168,6 +239,18 @@ void qthread_cond_broadcast(qthread_cond_t *cond);
 
 // I/O related functions
 
+/**
+ * Park the current thread until the scheduler's select() reports
+ * that fd is ready for the given mode. This is the primitive that
+ * all the qthread I/O functions below are built on; the caller is
+ * responsible for putting fd in non-blocking mode and for retrying
+ * the operation after it returns.
+ *
+ * @param fd file descriptor
+ * @param status read_mode or write_mode
+ */
+void qthread_wait_fd(int fd, io_status status);
+
 /**
  * Thread read function.
  *
@@ -200,8 +283,31 @@ ssize_t qthread_read(int sockfd, void *buf, size_t len);
  */
 ssize_t qthread_recv(int sockfd, void *buf, size_t len, int flags);
 
+/**
+ * Thread accept function for socket. accept() counts as a 'read'
+ * for the select call.
+ *
+ * @param sockfd listening socket
+ * @param addr peer address
+ * @param addrlen length of peer address
+ * @return file descriptor of accepted socket.
+ */
 int qthread_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 
+/**
+ * Thread connect function for socket.
+ *
+ * The connect is started in non-blocking mode; if it is still in
+ * progress the thread waits for the socket to become writable and
+ * then picks up the result from SO_ERROR.
+ *
+ * @param sockfd socket
+ * @param addr address to connect to
+ * @param addrlen length of address
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int qthread_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
+
 /**
  * Thread write function.
  *
@@ -227,4 +333,18 @@ ssize_t qthread_write(int sockfd, void *buf, size_t len);
  */
 ssize_t qthread_send(int sockfd, void *buf, size_t len, int flags);
 
+/**
+ * Thread sendfile function - copy up to count bytes from in_fd,
+ * starting at *offset, to the socket out_fd without passing them
+ * through user space. Waits for the socket to become writable like
+ * qthread_write does.
+ *
+ * @param out_fd socket to send to
+ * @param in_fd file to read from
+ * @param offset file offset to start from, updated past the bytes sent
+ * @param count largest number of bytes to send
+ * @return number of bytes sent, or -1 on error.
+ */
+ssize_t qthread_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
 #endif
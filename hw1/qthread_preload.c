@@ -0,0 +1,300 @@
+/*
+ * file:        qthread_preload.c
+ * description: LD_PRELOAD shim turning blocking libc I/O into qthread
+ *              parking calls
+ * class:       CS 5600, Spring 2018
+ *
+ * Usage:
+ *      LD_PRELOAD=./libqthread_preload.so ./server
+ *
+ * The program has to be linked with qthread.o and -rdynamic so the
+ * shim can find qthread_self() and friends. When one of the wrapped
+ * calls is made on a qthread on a blocking descriptor, the descriptor
+ * is put in non-blocking mode for the length of the call (just like
+ * qthread_read does, but put back afterwards) and the thread parks in
+ * the scheduler's select() instead of stalling the whole process.
+ * recv() and send() use MSG_DONTWAIT instead of touching the flags.
+ * Descriptors the program made non-blocking itself, MSG_DONTWAIT
+ * calls, calls made outside of any qthread, and all calls in programs
+ * that don't use qthreads at all go straight through to libc, so they
+ * still get EAGAIN. (While a thread is parked, other processes sharing
+ * the descriptor do see it as non-blocking.)
+ *
+ * Limitation: poll() only parks for a single descriptor with no
+ * timeout. Any other poll is re-checked every PEND_TIME usecs, i.e.
+ * the calling thread busy-polls, though other threads run in between.
+ *
+ * Note that the shim never calls back into qthread_read() etc. -
+ * those call read() themselves, which would land right back here.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include "qthread.h"
+
+/* resolved by the main program if it links qthread.o, NULL otherwise
+ */
+extern qthread_t qthread_self(void) __attribute__((weak));
+extern void qthread_wait_fd(int fd, io_status status) __attribute__((weak));
+extern void qthread_usleep(long int usecs) __attribute__((weak));
+extern long long qthread_get_usecs(void) __attribute__((weak));
+
+/**
+ * The real libc entry points.
+ */
+static struct {
+    ssize_t (*read)(int, void *, size_t);
+    ssize_t (*write)(int, const void *, size_t);
+    ssize_t (*recv)(int, void *, size_t, int);
+    ssize_t (*send)(int, const void *, size_t, int);
+    int     (*accept)(int, struct sockaddr *, socklen_t *);
+    int     (*connect)(int, const struct sockaddr *, socklen_t);
+    int     (*poll)(struct pollfd *, nfds_t, int);
+    unsigned int (*sleep)(unsigned int);
+    int     (*usleep)(useconds_t);
+    int     (*nanosleep)(const struct timespec *, struct timespec *);
+} real;
+
+/**
+ * Look up the next definition of every wrapped function.
+ */
+static void __attribute__((constructor)) init_real(void) {
+    real.read      = dlsym(RTLD_NEXT, "read");
+    real.write     = dlsym(RTLD_NEXT, "write");
+    real.recv      = dlsym(RTLD_NEXT, "recv");
+    real.send      = dlsym(RTLD_NEXT, "send");
+    real.accept    = dlsym(RTLD_NEXT, "accept");
+    real.connect   = dlsym(RTLD_NEXT, "connect");
+    real.poll      = dlsym(RTLD_NEXT, "poll");
+    real.sleep     = dlsym(RTLD_NEXT, "sleep");
+    real.usleep    = dlsym(RTLD_NEXT, "usleep");
+    real.nanosleep = dlsym(RTLD_NEXT, "nanosleep");
+}
+
+/**
+ * Check whether the caller is running on a qthread.
+ *
+ * @return true if the call should be routed into the qthread paths.
+ */
+static bool on_qthread(void) {
+    return qthread_self != NULL && qthread_self() != NULL;
+}
+
+/* calls in progress on each descriptor that the shim switched to
+ * non-blocking; the caller still thinks of it as blocking
+ */
+static int switched[FD_SETSIZE];
+
+/**
+ * Check whether a call on fd may park, without touching the flags:
+ * fd has to be one select() can handle, and blocking as far as the
+ * caller knows.
+ *
+ * @param fd file descriptor
+ * @return true if the call should park on EAGAIN
+ */
+static bool may_park(int fd) {
+    int tmp;
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        return false;
+    }
+    if (switched[fd] > 0) {
+        return true;
+    }
+    tmp = fcntl(fd, F_GETFL, 0);
+    return tmp != -1 && !(tmp & O_NONBLOCK);
+}
+
+/**
+ * Get ready to park in a call on fd: if the caller's descriptor is
+ * blocking, switch it to non-blocking until park_end().
+ *
+ * @param fd file descriptor
+ * @return true if the call should park on EAGAIN, false if it should
+ *         go straight to libc (fd is non-blocking, or out of range)
+ */
+static bool park_begin(int fd) {
+    int tmp;
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        return false;
+    }
+    if (switched[fd] > 0) {
+        switched[fd]++;
+        return true;
+    }
+    tmp = fcntl(fd, F_GETFL, 0);
+    if (tmp == -1 || (tmp & O_NONBLOCK) ||
+        fcntl(fd, F_SETFL, tmp | O_NONBLOCK) == -1) {
+        return false;
+    }
+    switched[fd] = 1;
+    return true;
+}
+
+/**
+ * Done with a call that park_begin() said parks: put the descriptor
+ * back in blocking mode when no other call is using it.
+ *
+ * @param fd file descriptor
+ */
+static void park_end(int fd) {
+    int tmp, err = errno;
+    if (--switched[fd] == 0 && (tmp = fcntl(fd, F_GETFL, 0)) != -1) {
+        fcntl(fd, F_SETFL, tmp & ~O_NONBLOCK);
+    }
+    errno = err;
+}
+
+/* qthread_usleep takes a long, which is 32 bits in the -m32 build -
+ * sleep in pieces of at most SLEEP_CHUNK usecs (1000 secs).
+ */
+#define SLEEP_CHUNK 1000000000LL
+
+static void park_usecs(long long usecs) {
+    while (usecs > 0) {
+        long chunk = usecs < SLEEP_CHUNK ? usecs : SLEEP_CHUNK;
+        qthread_usleep(chunk);
+        usecs -= chunk;
+    }
+}
+
+ssize_t read(int fd, void *buf, size_t len) {
+    ssize_t val;
+    if (!on_qthread() || !park_begin(fd)) {
+        return real.read(fd, buf, len);
+    }
+    while ((val = real.read(fd, buf, len)) == -1 && errno == EAGAIN) {
+        qthread_wait_fd(fd, read_mode);
+    }
+    park_end(fd);
+    return val;
+}
+
+ssize_t write(int fd, const void *buf, size_t len) {
+    ssize_t val;
+    if (!on_qthread() || !park_begin(fd)) {
+        return real.write(fd, buf, len);
+    }
+    while ((val = real.write(fd, buf, len)) == -1 && errno == EAGAIN) {
+        qthread_wait_fd(fd, write_mode);
+    }
+    park_end(fd);
+    return val;
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags) {
+    ssize_t val;
+    if (!on_qthread() || (flags & MSG_DONTWAIT) || !may_park(fd)) {
+        return real.recv(fd, buf, len, flags);
+    }
+    while ((val = real.recv(fd, buf, len, flags | MSG_DONTWAIT)) == -1 &&
+           errno == EAGAIN) {
+        qthread_wait_fd(fd, read_mode);
+    }
+    return val;
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags) {
+    ssize_t val;
+    if (!on_qthread() || (flags & MSG_DONTWAIT) || !may_park(fd)) {
+        return real.send(fd, buf, len, flags);
+    }
+    while ((val = real.send(fd, buf, len, flags | MSG_DONTWAIT)) == -1 &&
+           errno == EAGAIN) {
+        qthread_wait_fd(fd, write_mode);
+    }
+    return val;
+}
+
+int accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+    int val;
+    if (!on_qthread() || !park_begin(fd)) {
+        return real.accept(fd, addr, addrlen);
+    }
+    while ((val = real.accept(fd, addr, addrlen)) == -1 && errno == EAGAIN) {
+        qthread_wait_fd(fd, read_mode);
+    }
+    park_end(fd);
+    return val;
+}
+
+int connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+    int err, val;
+    socklen_t len = sizeof(err);
+    if (!on_qthread() || !park_begin(fd)) {
+        return real.connect(fd, addr, addrlen);
+    }
+    val = real.connect(fd, addr, addrlen);
+    if (val == -1 && errno == EINPROGRESS) {
+        qthread_wait_fd(fd, write_mode);
+        val = getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (val == 0 && err != 0) {
+            errno = err;
+            val = -1;
+        }
+    }
+    park_end(fd);
+    return val;
+}
+
+/* poll - a single descriptor with no timeout parks on that descriptor
+ * like read/write do. Anything else (several descriptors, or a
+ * timeout) is re-checked every PEND_TIME usecs, sleeping on the
+ * qthread timer queue in between so other threads keep running. The
+ * timeout is measured on the qthread clock, so it runs in virtual
+ * time when the virtual clock is on.
+ */
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    int val;
+    long long deadline;
+    if (!on_qthread() || timeout == 0) {
+        return real.poll(fds, nfds, timeout);
+    }
+    deadline = qthread_get_usecs() + timeout * 1000LL;
+    while ((val = real.poll(fds, nfds, 0)) == 0) {
+        if (timeout > 0 && qthread_get_usecs() >= deadline) {
+            break;
+        }
+        if (nfds == 1 && timeout < 0) {
+            qthread_wait_fd(fds[0].fd,
+                            (fds[0].events & POLLOUT) ? write_mode : read_mode);
+        } else {
+            qthread_usleep(PEND_TIME);
+        }
+    }
+    return val;
+}
+
+unsigned int sleep(unsigned int secs) {
+    if (!on_qthread()) {
+        return real.sleep(secs);
+    }
+    park_usecs(secs * 1000000LL);
+    return 0;
+}
+
+int usleep(useconds_t usecs) {
+    if (!on_qthread()) {
+        return real.usleep(usecs);
+    }
+    qthread_usleep(usecs);
+    return 0;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+    if (!on_qthread()) {
+        return real.nanosleep(req, rem);
+    }
+    park_usecs(req->tv_sec * 1000000LL + req->tv_nsec / 1000);
+    if (rem != NULL) {
+        rem->tv_sec = rem->tv_nsec = 0;
+    }
+    return 0;
+}
@@ -5,12 +5,16 @@
 //this simple web server is capable of serving simple html, jpg, gif & text files
  
 //----- Include files ---------------------------------------------------------
+#define _GNU_SOURCE         // for strptime(), timegm()
 #include <stdio.h>          // for printf()
 #include <stdlib.h>         // for exit()
 #include <string.h>         // for strcpy(),strerror() and strlen()
+#include <strings.h>        // for strncasecmp()
+#include <ctype.h>          // for isdigit()
 #include <fcntl.h>          // for file i/o constants
 #include <sys/stat.h>       // for file i/o constants
 #include <errno.h>
+#include <time.h>           // for strftime(), strptime(), timegm()
  
 /* FOR BSD UNIX/LINUX  ---------------------------------------------------- */
 #include <unistd.h>
@@ -18,6 +22,7 @@
 #include <netinet/in.h>     
 #include <sys/socket.h>     /* for socket system calls   */
 #include <arpa/inet.h>      /* for socket system calls (bind)  */
+#include <sys/un.h>         /* for unix-domain proxy backends  */
 #include <sched.h>   
 #include "qthread.h"        /* P-thread implementation        */    
 #include <signal.h>         /* for signal                     */ 
@@ -25,18 +30,496 @@
 /* ------------------------------------------------------------------------ */ 
  
 //----- HTTP response messages ----------------------------------------------
-#define OK_IMAGE    "HTTP/1.0 200 OK\nContent-Type:image/gif\n\n"
 #define OK_TEXT     "HTTP/1.0 200 OK\nContent-Type:text/html\n\n"
 #define NOTOK_404   "HTTP/1.0 404 Not Found\nContent-Type:text/html\n\n"
 #define MESS_404    "<html><body><h1>FILE NOT FOUND</h1></body></html>"
 #define MOVED_302   "HTTP/1.0 302 Found\nLocation: /index.html\n\n"
+#define BAD_GW_502  "HTTP/1.0 502 Bad Gateway\nContent-Type:text/html\n\n"
+#define OK_200      "HTTP/1.0 200 OK"
+#define PARTIAL_206 "HTTP/1.0 206 Partial Content"
+#define NOTMOD_304  "HTTP/1.0 304 Not Modified"
+#define RANGE_416   "HTTP/1.0 416 Range Not Satisfiable"
+#define HTTP_DATE   "%a, %d %b %Y %H:%M:%S GMT"
 
 //----- Defines -------------------------------------------------------------
 #define BUF_SIZE            1024 /* buffer size in bytes */
 #define PEND_CONNECTIONS     100 /* pending connections to hold  */
 #define TRUE                   1
 #define FALSE                  0
+#define HDR_SIZE             256 /* max length of a header value */
+#define MAX_ROUTES            16 /* -proxy prefixes */
+#define RELAY_CHUNK        65536 /* bytes moved per splice */
  
+/* Find request header 'name' and copy its value (without leading
+ * blanks or the line end) into 'val'. Returns TRUE if found.
+ */
+static int find_header(char *req, char *name, char *val, int len)
+{
+    int   n = strlen(name);
+    char *line;
+    for (line = strchr(req, '\n'); line != NULL; line = strchr(line, '\n')) {
+        line++;
+        if (strncasecmp(line, name, n) == 0 && line[n] == ':') {
+            char *v = line + n + 1;
+            while (*v == ' ' || *v == '\t')
+                v++;
+            int i;
+            for (i = 0; i < len - 1 && v[i] && v[i] != '\r' && v[i] != '\n'; i++)
+                val[i] = v[i];
+            val[i] = 0;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Decide whether the client's cached copy is still good: If-None-Match
+ * wins over If-Modified-Since when both are present.
+ */
+static int not_modified(char *req, char *etag, time_t mtime)
+{
+    char      val[HDR_SIZE];
+    struct tm tm;
+    if (find_header(req, "If-None-Match", val, HDR_SIZE))
+        return strstr(val, etag) != NULL || !strcmp(val, "*");
+    if (find_header(req, "If-Modified-Since", val, HDR_SIZE)) {
+        memset(&tm, 0, sizeof(tm));
+        if (strptime(val, HTTP_DATE, &tm) != NULL)
+            return mtime <= timegm(&tm);
+    }
+    return FALSE;
+}
+
+/* Parse a single "Range: bytes=first-last" header against a file of
+ * 'size' bytes. Returns 0 if there is no usable range (serve the whole
+ * file), 1 for a satisfiable range, -1 for an unsatisfiable one.
+ * Malformed and multiple ranges are ignored and get the whole file.
+ */
+static int parse_range(char *req, off_t size, off_t *first, off_t *last)
+{
+    char  val[HDR_SIZE], *end;
+    long long a, b;
+    if (!find_header(req, "Range", val, HDR_SIZE) ||
+        strncmp(val, "bytes=", 6) != 0 || strchr(val, ',') != NULL)
+        return 0;
+    char *spec = val + 6;
+    if (*spec == '-') {                 /* suffix: the last N bytes */
+        if (!isdigit((unsigned char)spec[1]))
+            return 0;
+        b = strtoll(spec + 1, &end, 10);
+        if (*end != '\0')
+            return 0;
+        if (b <= 0)
+            return -1;
+        *first = b < size ? size - b : 0;
+        *last  = size - 1;
+    } else {
+        if (!isdigit((unsigned char)*spec))
+            return 0;
+        a = strtoll(spec, &end, 10);
+        if (*end != '-')
+            return 0;
+        spec = end + 1;
+        b = size - 1;
+        if (*spec) {
+            if (!isdigit((unsigned char)*spec))
+                return 0;
+            b = strtoll(spec, &end, 10);
+            if (*end != '\0')
+                return 0;
+        }
+        if (a >= size || b < a)
+            return -1;
+        *first = a;
+        *last  = b < size ? b : size - 1;
+    }
+    return size > 0 ? 1 : -1;
+}
+
+/* Precompressed sidecars, in order of preference. They are built
+ * offline (see precompress.sh) - we never compress on the request path.
+ */
+static struct {
+    char *coding;
+    char *suffix;
+} sidecars[] = {
+    {"br",   ".br"},
+    {"gzip", ".gz"},
+};
+#define NUM_SIDECARS (sizeof(sidecars) / sizeof(sidecars[0]))
+
+/* Check whether an Accept-Encoding value allows 'coding' - it has to
+ * be listed (or '*' has to be) without ";q=0".
+ */
+static int accepts(char *val, char *coding)
+{
+    int   n = strlen(coding), len;
+    char *tok, *end, *q;
+    for (tok = val; tok != NULL; tok = end ? end + 1 : NULL) {
+        end = strchr(tok, ',');
+        while (*tok == ' ' || *tok == '\t')
+            tok++;
+        len = strcspn(tok, ",; \t");
+        if ((len == n && !strncasecmp(tok, coding, n)) ||
+            (len == 1 && *tok == '*')) {
+            q = strstr(tok, "q=");
+            return q == NULL || (end != NULL && q > end) ||
+                strtod(q + 2, NULL) > 0;
+        }
+    }
+    return FALSE;
+}
+
+/* Look for an up-to-date 'path.br' / 'path.gz' next to the file the
+ * client asked for. Returns an open descriptor for the best one the
+ * client accepts (and its coding in *coding), or -1 to send the
+ * original. *vary is set if any sidecar exists, since the response
+ * then depends on Accept-Encoding either way.
+ */
+static int open_sidecar(char *path, int fh, char *req, char **coding, int *vary)
+{
+    char        name[BUF_SIZE], val[HDR_SIZE];
+    struct stat orig, st;
+    int         i, efh = -1;
+    int         has_ae = find_header(req, "Accept-Encoding", val, HDR_SIZE);
+
+    *coding = NULL;
+    *vary = FALSE;
+    if (fstat(fh, &orig) < 0 || !S_ISREG(orig.st_mode))
+        return -1;
+    for (i = 0; i < NUM_SIDECARS; i++) {
+        snprintf(name, BUF_SIZE, "%s%s", path, sidecars[i].suffix);
+        if (stat(name, &st) < 0 || !S_ISREG(st.st_mode) ||
+            st.st_mtime < orig.st_mtime)
+            continue;               /* missing or stale */
+        *vary = TRUE;
+        if (efh == -1 && has_ae && accepts(val, sidecars[i].coding) &&
+            (efh = open(name, O_RDONLY)) != -1)
+            *coding = sidecars[i].coding;
+    }
+    return efh;
+}
+
+/* Serve an open file: validators, conditional GET and single byte
+ * ranges. The body goes out with sendfile, starting at the range
+ * offset. If 'coding' is set, fh is a precompressed sidecar of
+ * file_name and is labelled with that Content-Encoding.
+ */
+static int serve_file(int client, int fh, char *file_name, char *req,
+                      char *coding, int vary, long long *sent)
+{
+    char        out_buf[BUF_SIZE];
+    char        etag[HDR_SIZE], last_mod[HDR_SIZE];
+    char       *type = "text/html";
+    struct stat st;
+    struct tm   tm;
+    off_t       first = 0, last, off;
+    int         n, range;
+
+    if ((strstr(file_name, ".jpg") != NULL) ||
+        (strstr(file_name, ".gif") != NULL))
+        type = "image/gif";
+
+    fstat(fh, &st);
+    last = st.st_size - 1;
+    snprintf(etag, HDR_SIZE, "\"%llx-%llx%s%s\"",
+             (long long)st.st_size, (long long)st.st_mtime,
+             coding ? "-" : "", coding ? coding : "");
+    strftime(last_mod, HDR_SIZE, HTTP_DATE, gmtime_r(&st.st_mtime, &tm));
+
+    if (not_modified(req, etag, st.st_mtime)) {
+        n = snprintf(out_buf, BUF_SIZE, NOTMOD_304 "\nETag: %s\n"
+                     "Last-Modified: %s\n%s\n", etag, last_mod,
+                     vary ? "Vary: Accept-Encoding\n" : "");
+        qthread_send(client, out_buf, n, 0);
+        return 304;
+    }
+
+    range = parse_range(req, st.st_size, &first, &last);
+    if (range < 0) {
+        n = snprintf(out_buf, BUF_SIZE, RANGE_416 "\nContent-Range: "
+                     "bytes */%lld\n\n", (long long)st.st_size);
+        qthread_send(client, out_buf, n, 0);
+        return 416;
+    }
+
+    n = snprintf(out_buf, BUF_SIZE, "%s\nContent-Type:%s\n"
+                 "Content-Length: %lld\nETag: %s\nLast-Modified: %s\n"
+                 "Accept-Ranges: bytes\n", range ? PARTIAL_206 : OK_200,
+                 type, (long long)(last - first + 1), etag, last_mod);
+    if (coding)
+        n += snprintf(out_buf + n, BUF_SIZE - n, "Content-Encoding: %s\n",
+                      coding);
+    if (vary)
+        n += snprintf(out_buf + n, BUF_SIZE - n, "Vary: Accept-Encoding\n");
+    if (range)
+        n += snprintf(out_buf + n, BUF_SIZE - n, "Content-Range: "
+                      "bytes %lld-%lld/%lld\n", (long long)first,
+                      (long long)last, (long long)st.st_size);
+    n += snprintf(out_buf + n, BUF_SIZE - n, "\n");
+    qthread_send(client, out_buf, n, 0);
+
+    for (off = first; off <= last; ) {
+        if (qthread_sendfile(client, fh, &off, last - off + 1) <= 0)
+            break;
+    }
+    *sent = off - first;
+    return range ? 206 : 200;
+}
+ 
+//----- Access log ----------------------------------------------------------
+/* Request handlers never print. They drop a fixed-size record into an
+ * in-memory ring, and log_thread formats whatever has piled up and
+ * writes it out in one large non-blocking write every LOG_INTERVAL.
+ * If the ring is full the record is dropped and counted instead of
+ * making the handler wait for the log.
+ */
+#define LOG_RING            4096 /* records held between flushes */
+#define LOG_BATCH          65536 /* bytes formatted per write */
+#define LOG_INTERVAL      100000 /* usecs between flushes */
+
+struct log_rec {
+    long long start;            /* request start, qthread clock usecs */
+    long      usecs;            /* latency */
+    long long bytes;            /* body bytes sent */
+    int       status;           /* HTTP status, 0 if no request */
+    char      method[8];
+    char      path[116];
+};
+
+struct log_rec log_ring[LOG_RING];
+unsigned long  log_head;        /* next record to fill */
+unsigned long  log_tail;        /* next record to flush */
+unsigned long  log_dropped;     /* records lost to a full ring */
+
+/* Append a record for a finished request to the ring.
+ */
+static void log_access(char *method, char *path, int status,
+                       long long bytes, long long start)
+{
+    if (log_head - log_tail == LOG_RING) {
+        log_dropped++;
+        return;
+    }
+    struct log_rec *r = &log_ring[log_head % LOG_RING];
+    r->start  = start;
+    r->usecs  = qthread_get_usecs() - start;
+    r->bytes  = bytes;
+    r->status = status;
+    snprintf(r->method, sizeof(r->method), "%s", method ? method : "-");
+    snprintf(r->path, sizeof(r->path), "%s", path ? path : "-");
+    log_head++;
+}
+
+/* Write a whole buffer to the log descriptor.
+ */
+static void log_write(char *buf, int len)
+{
+    int n;
+    while (len > 0 && (n = qthread_write(1, buf, len)) > 0) {
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Logger thread - flush the ring in big batches.
+ */
+void *log_thread(void *arg)
+{
+    static char   buf[LOG_BATCH];
+    unsigned long dropped = 0;
+    struct tm     tm;
+    while (TRUE) {
+        qthread_usleep(LOG_INTERVAL);
+        int len = 0;
+        if (log_dropped != dropped) {
+            len += snprintf(buf, LOG_BATCH, "# %lu log records dropped\n",
+                            log_dropped - dropped);
+            dropped = log_dropped;
+        }
+        while (log_tail != log_head) {
+            struct log_rec *r = &log_ring[log_tail % LOG_RING];
+            time_t t = r->start / 1000000;
+            char   date[32];
+            if (LOG_BATCH - len < sizeof(*r) + 64) {
+                log_write(buf, len);
+                len = 0;
+            }
+            strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S",
+                     gmtime_r(&t, &tm));
+            len += snprintf(buf + len, LOG_BATCH - len,
+                            "[%s] \"%s %s\" %d %lld %ldus\n", date,
+                            r->method, r->path, r->status, r->bytes, r->usecs);
+            log_tail++;
+        }
+        log_write(buf, len);
+    }
+    return 0;
+}
+
+//----- Reverse proxy -------------------------------------------------------
+/* Requests whose path starts with a configured prefix are forwarded to
+ * a local backend. Bytes are moved with splice() through a pipe, so the
+ * payload never enters user space; each direction parks on readiness
+ * through qthread_wait_fd like any other qthread I/O.
+ */
+struct proxy_route {
+    char                    prefix[HDR_SIZE];
+    struct sockaddr_storage addr;
+    socklen_t               addrlen;
+};
+
+struct proxy_route routes[MAX_ROUTES];
+int                nroutes;
+
+/* Parse "/prefix=unix:/path/to/socket" or "/prefix=127.0.0.1:port"
+ * into a route. Returns FALSE if the spec is malformed.
+ */
+static int add_route(char *spec)
+{
+    struct proxy_route *r = &routes[nroutes];
+    char               *target = strchr(spec, '=');
+    if (nroutes == MAX_ROUTES || target == NULL || target == spec ||
+        target - spec >= HDR_SIZE)
+        return FALSE;
+    memset(r, 0, sizeof(*r));
+    memcpy(r->prefix, spec, target - spec);
+    target++;
+
+    if (!strncmp(target, "unix:", 5)) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&r->addr;
+        if (strlen(target + 5) >= sizeof(un->sun_path))
+            return FALSE;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, target + 5);
+        r->addrlen = sizeof(*un);
+    } else {
+        struct sockaddr_in *in = (struct sockaddr_in *)&r->addr;
+        char               *port = strrchr(target, ':');
+        if (port == NULL)
+            return FALSE;
+        *port++ = 0;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(atoi(port));
+        if (inet_pton(AF_INET, target, &in->sin_addr) != 1)
+            return FALSE;
+        r->addrlen = sizeof(*in);
+    }
+    nroutes++;
+    return TRUE;
+}
+
+/* Find the route for the path in a request line, if any.
+ */
+static struct proxy_route *find_route(char *req)
+{
+    char *path = strchr(req, ' ');
+    int   i;
+    if (path == NULL)
+        return NULL;
+    path++;
+    for (i = 0; i < nroutes; i++)
+        if (!strncmp(path, routes[i].prefix, strlen(routes[i].prefix)))
+            return &routes[i];
+    return NULL;
+}
+
+/* Move bytes from one socket to another through a pipe until 'from'
+ * reaches EOF or either side fails - e.g. EPIPE when 'to' has gone
+ * away (SIGPIPE is ignored, see main). Returns the number of bytes
+ * moved.
+ */
+static long long relay(int from, int to)
+{
+    int       pfd[2];
+    ssize_t   n, m;
+    long long total = 0;
+    if (pipe(pfd) < 0)
+        return 0;
+    while (TRUE) {
+        n = splice(from, NULL, pfd[1], NULL, RELAY_CHUNK,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == -1 && errno == EAGAIN) {
+            qthread_wait_fd(from, read_mode);
+            continue;
+        }
+        if (n <= 0)
+            break;
+        /* the pipe is drained before the next fill, so EAGAIN below
+         * can only mean the destination socket is full */
+        while (n > 0) {
+            m = splice(pfd[0], NULL, to, NULL, n,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (m == -1 && errno == EAGAIN) {
+                qthread_wait_fd(to, write_mode);
+                continue;
+            }
+            if (m <= 0)
+                goto out;
+            n -= m;
+            total += m;
+        }
+    }
+out:
+    close(pfd[0]);
+    close(pfd[1]);
+    return total;
+}
+
+/* client -> backend direction, run in its own thread. When the client
+ * is done sending, pass the EOF on to the backend.
+ */
+void *relay_up(void *arg)
+{
+    int *fds = arg;
+    relay(fds[0], fds[1]);
+    shutdown(fds[1], SHUT_WR);
+    return 0;
+}
+
+/* Forward a request to its backend: replay the bytes already read from
+ * the client, then relay both directions until the backend closes.
+ * Returns the backend's status (502 if it can't be reached) and sets
+ * *sent to the number of response bytes relayed.
+ */
+static int proxy_request(int client, struct proxy_route *r, char *req,
+                         int len, long long *sent)
+{
+    char    head[16];
+    int     fds[2], n, status = 0;
+    int     backend = socket(r->addr.ss_family, SOCK_STREAM, 0);
+
+    if (backend < 0 ||
+        qthread_connect(backend, (struct sockaddr *)&r->addr, r->addrlen) < 0) {
+        if (backend >= 0)
+            close(backend);
+        qthread_send(client, BAD_GW_502, strlen(BAD_GW_502), 0);
+        return 502;
+    }
+    while (len > 0 && (n = qthread_send(backend, req, len, 0)) > 0) {
+        req += n;
+        len -= n;
+    }
+
+    fds[0] = client;
+    fds[1] = backend;
+    qthread_t up = qthread_create(relay_up, fds);
+
+    /* peek at the status line for the log - this doesn't consume it */
+    n = qthread_recv(backend, head, sizeof(head) - 1, MSG_PEEK);
+    if (n > 0) {
+        head[n] = 0;
+        sscanf(head, "HTTP/%*s %d", &status);
+    }
+    *sent = relay(backend, client);
+
+    /* backend is done - unblock the other direction and wait for it */
+    shutdown(client, SHUT_RD);
+    qthread_join(up);
+    close(backend);
+    return status;
+}
+
 /* Child thread implementation ----------------------------------------- */
 void *my_thread(void * arg)
 {
@@ -46,16 +529,21 @@ void *my_thread(void * arg)
     char           in_buf[BUF_SIZE];           // Input buffer for GET resquest
     char           out_buf[BUF_SIZE];          // Output buffer for HTML response
     char           *file_name;                 // File name
-    unsigned int   buf_len;                    // Buffer length for file reads
+    char           *method;                    // Request method
     int   retcode;                    // Return code
+    int   status;                     // Response status for the log
+    long long      sent = 0;                   // Body bytes for the log
+    long long      start = qthread_get_usecs(); // Start time for the log
     char           *p;
     
     myClient_s = (unsigned int)arg;        // copy the socket
  
     /* receive the first HTTP request (HTTP GET) ------- */
     do {
-        retcode = qthread_recv(myClient_s, in_buf, BUF_SIZE, 0);
+        retcode = qthread_recv(myClient_s, in_buf, BUF_SIZE - 1, 0);
         if (retcode == 0){
+            close(myClient_s);
+            log_access(NULL, NULL, 0, 0, start);
             return 0;
         }
         if (retcode < 0){
@@ -65,7 +553,8 @@ void *my_thread(void * arg)
  
     /* if receive error --- */
     if (retcode < 0){
-        printf("Client %d exited\n", myClient_s);
+        close(myClient_s);
+        log_access(NULL, NULL, 0, 0, start);
         qthread_exit(NULL);
         return 0;
     }
@@ -73,9 +562,27 @@ void *my_thread(void * arg)
     /* if HTTP command successfully received --- */
     else {
         unsigned int fh;  // File handle (file descriptor)
+        in_buf[retcode] = 0;
+
+        /* Hand proxied prefixes to their backend --- */
+        struct proxy_route *route = find_route(in_buf);
+        if (route != NULL) {
+            char req_method[16] = "", path[HDR_SIZE] = "";
+            sscanf(in_buf, "%15s %255s", req_method, path);
+            status = proxy_request(myClient_s, route, in_buf, retcode, &sent);
+            close(myClient_s);
+            log_access(req_method[0] ? req_method : NULL, path[0] ? path : NULL,
+                       status, sent, start);
+            qthread_exit(NULL);
+        }
         /* Parse out the filename from the GET request --- */
-        strtok_r(in_buf, " ", &p);
+        method = strtok_r(in_buf, " ", &p);
         file_name = strtok_r(NULL, " ", &p);
+        if (file_name == NULL) {
+            close(myClient_s);
+            log_access(method, NULL, 0, 0, start);
+            qthread_exit(NULL);
+        }
  
         /* Open the requested file (start at 2nd char to get rid */
         /* of leading "\") */
@@ -84,6 +591,7 @@ void *my_thread(void * arg)
         if (!strcmp(file_name, "/")) {
             strcpy(out_buf, MOVED_302);
             qthread_send(myClient_s, out_buf, strlen(out_buf), 0);
+            status = 302;
         }
         else if (!strcmp(file_name, "/index.html")) {
             strcpy(out_buf, OK_TEXT);
@@ -95,41 +603,40 @@ void *my_thread(void * arg)
             while (1) {
                 int n = fread(out_buf, 1, BUF_SIZE, fp);
                 qthread_send(myClient_s, out_buf, n, 0);
+                sent += n;
                 if (n < BUF_SIZE)
                     break;
             }
+            pclose(fp);
+            status = 200;
         }
         
         /* Generate and send the response (404 if could not open the file) */
         else if (fh == -1) {
-            printf("File %s not found - sending HTTP 404 \n", &file_name[1]);
             strcpy(out_buf, NOTOK_404);
             qthread_send(myClient_s, out_buf, strlen(out_buf), 0);
             strcpy(out_buf, MESS_404);
             qthread_send(myClient_s, out_buf, strlen(out_buf), 0);
+            sent = strlen(MESS_404);
+            status = 404;
         }
         else {
-            if ((strstr(file_name, ".jpg") != NULL) ||
-                (strstr(file_name, ".gif") != NULL)) {
-                strcpy(out_buf, OK_IMAGE);
+            char *coding;
+            int   vary;
+            int   efh = open_sidecar(&file_name[1], fh, p, &coding, &vary);
+            if (efh != -1) {
+                status = serve_file(myClient_s, efh, file_name, p, coding,
+                                    vary, &sent);
+                close(efh);
             }
             else {
-                strcpy(out_buf, OK_TEXT);
-            }
-            qthread_send(myClient_s, out_buf, strlen(out_buf), 0);
- 
-            buf_len = 1;  
-            while (buf_len > 0) {
-                buf_len = qthread_read(fh, out_buf, BUF_SIZE);
-                /* hack - we'll assume send is non-blocking */
-                if (buf_len > 0){
-                    qthread_send(myClient_s, out_buf, buf_len, 0);     
-                }
+                status = serve_file(myClient_s, fh, file_name, p, NULL,
+                                    vary, &sent);
             }
         }
         close(fh);       // close the file
         close(myClient_s); // close the client connection
-        printf("Client %d exited\n", myClient_s);
+        log_access(method, file_name, status, sent, start);
         qthread_exit(NULL);
     }
     return 0;
@@ -145,7 +652,6 @@ void *main_thread(void *arg)
     
     /* the web server main loop ============================================= */
     while(TRUE) {
-        printf("server ready ...\n");  
  
         /* wait for the next client to arrive -------------- */
         addr_len = sizeof(client_addr);
@@ -157,8 +663,6 @@ void *main_thread(void *arg)
             exit(1);
         }
         else {
-            printf("new client fd %d...\n", client_s);
-
             /* Create a child thread --------------------------------------- */
             qthread_create ( /* Create a child thread */
                 my_thread,             /* Thread routine               */
@@ -187,9 +691,22 @@ int main(int argc, char **argv)
         perror("setsockopt(SO_REUSEADDR) failed");
     }
 
+    /* a client or backend that hangs up mid-relay must not kill the
+     * server: writes to it fail with EPIPE instead */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* usage: server [port] [-proxy /prefix=unix:/path | /prefix=ip:port]... */
     int port_num = 8080;
-    if (argc > 1)
-        port_num = atoi(argv[1]);
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-proxy") && i + 1 < argc) {
+            if (!add_route(argv[++i])) {
+                fprintf(stderr, "bad -proxy %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else
+            port_num = atoi(argv[i]);
+    }
 
     /* fill-in address information, and then bind it ------------------------ */
     server_addr.sin_family = AF_INET;
@@ -200,6 +717,10 @@ int main(int argc, char **argv)
     /* Listen for connections and then accept ------------------------------- */
     listen(server_s, PEND_CONNECTIONS);
 
+    printf("server ready on port %d ...\n", port_num);
+    fflush(stdout);
+
+    qthread_create(log_thread, NULL);
     qthread_create(main_thread, &server_s);
     qthread_run();
     close(server_s);
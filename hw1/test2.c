@@ -4,14 +4,17 @@
 #include <assert.h>
 #include "qthread.h"
 
-#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 
+/* qthread clock - wall clock time, or virtual time after 'v' */
 static double get_time(void)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return tv.tv_sec + tv.tv_usec/1.0e6;
+    return qthread_get_usecs() / 1.0e6;
 }
 
 /*
@@ -339,11 +342,144 @@ void test1(void)
     assert(test1_ran == 1);
     printf("TEST 1: passed\n");
 }
-    
+
+/*
+qthread_poll_once - embed the scheduler in an external epoll loop
+one thread blocked in qthread_read on a pipe that the host loop writes to, and one thread in qthread_usleep; the host waits on qthread_poll_fd with qthread_poll_timeout until both exit
+*/
+int test6_read = 0, test6_slept = 0, test6_vclock = 0;
+
+void *run_test6_1(void *arg)
+{
+    int *fd = arg;
+    char c;
+    int val = qthread_read(fd[0], &c, 1);
+    assert(val == 1 && c == 17);
+    test6_read = 1;
+    return NULL;
+}
+
+void *run_test6_2(void *arg)
+{
+    qthread_usleep(100000);
+    test6_slept = 1;
+    return NULL;
+}
+
+void test6(void)
+{
+    int fd[2], loops = 0;
+    char c = 17;
+    struct epoll_event ev = {.events = EPOLLIN}, out;
+    pipe(fd);
+    qthread_create(run_test6_1, fd);
+    qthread_create(run_test6_2, NULL);
+
+    int host = epoll_create1(0);
+    epoll_ctl(host, EPOLL_CTL_ADD, qthread_poll_fd(), &ev);
+
+    double t1 = get_time();
+    while (qthread_poll_once() > 0) {
+        long usecs = qthread_poll_timeout();
+        if (loops++ == 0) {
+            // both threads parked, nothing has happened yet
+            assert(!test6_read && !test6_slept);
+            assert(0 < usecs || (usecs == 0 && test6_vclock));
+            assert(usecs <= 100000);
+            write(fd[1], &c, 1);
+        }
+        epoll_wait(host, &out, 1, usecs < 0 ? -1 : (usecs + 999) / 1000);
+    }
+    double t = get_time() - t1;
+
+    assert(test6_read && test6_slept);
+    assert(0.09 < t && t < 0.2);
+    close(host);
+    close(fd[0]);
+    close(fd[1]);
+    printf("TEST 6: passed\n");
+}
+
+/*
+plain libc calls under LD_PRELOAD=./libqthread_preload.so
+one thread blocked in a plain read() on a pipe, one that wakes it with usleep() and write(), and one that ticks with nanosleep() meanwhile - so the read parked instead of blocking the process. The pipe is blocking again afterwards, and a descriptor that was made non-blocking, or recv() with MSG_DONTWAIT, still gets EAGAIN
+*/
+int test7_ticks = 0, test7_read = 0;
+
+void *run_test7_1(void *arg)
+{
+    int *fd = arg;
+    char c;
+    assert(read(fd[0], &c, 1) == 1 && c == 7);
+    assert(test7_ticks > 0);
+    test7_read = 1;
+    return NULL;
+}
+
+void *run_test7_2(void *arg)
+{
+    int *fd = arg;
+    char c = 7;
+    usleep(100000);
+    assert(write(fd[1], &c, 1) == 1);
+    return NULL;
+}
+
+void *run_test7_3(void *arg)
+{
+    struct timespec ts = {0, 20000000};
+    while (!test7_read) {
+        test7_ticks++;
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+void *run_test7_4(void *arg)
+{
+    int *fd = arg, sv[2];
+    char c;
+    fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+    assert(read(fd[0], &c, 1) == -1 && errno == EAGAIN);
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    assert(recv(sv[0], &c, 1, MSG_DONTWAIT) == -1 && errno == EAGAIN);
+    assert(!(fcntl(sv[0], F_GETFL) & O_NONBLOCK));
+    close(sv[0]);
+    close(sv[1]);
+    return NULL;
+}
+
+void test7(void)
+{
+    int fd[2], fd2[2];
+    char *pre = getenv("LD_PRELOAD");
+    if (pre == NULL || strstr(pre, "qthread_preload") == NULL) {
+        printf("TEST 7: skipped, run with LD_PRELOAD=./libqthread_preload.so\n");
+        return;
+    }
+    pipe(fd);
+    pipe(fd2);
+    qthread_create(run_test7_1, fd);
+    qthread_create(run_test7_2, fd);
+    qthread_create(run_test7_3, NULL);
+    qthread_create(run_test7_4, fd2);
+    qthread_run();
+    assert(test7_read);
+    assert(!(fcntl(fd[0], F_GETFL) & O_NONBLOCK));
+    assert(!(fcntl(fd[1], F_GETFL) & O_NONBLOCK));
+    close(fd[0]);
+    close(fd[1]);
+    close(fd2[0]);
+    close(fd2[1]);
+    printf("TEST 7: passed\n");
+}
+
 int main(int argc, char** argv)
 {
     if (argc == 1){
-        printf("Give a set of tests numbers to run between 1-5, e.g '1' for test 1, or '134' for test 1, 3 and 4\n");
+        printf("Give a set of tests numbers to run between 1-7, e.g '1' for test 1, or '134' for test 1, 3 and 4\n");
+        printf("Test 7 needs LD_PRELOAD=./libqthread_preload.so\n");
+        printf("Put 'v' in front to run them on the virtual clock, e.g. 'v12345'\n");
         return 0;
     }
 
@@ -360,6 +496,14 @@ int main(int argc, char** argv)
         test4(); break;
     case '5':
         test5(); break;
+    case '6':
+        test6(); break;
+    case '7':
+        test7(); break;
+    case 'v':
+        qthread_set_vclock(true);
+        test6_vclock = 1;
+        break;
         default:
             printf("No such test: %c\n", c);
             break;
@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# Scale the number of customers and record how fast the Q3 kernel
+# runs, from its -profile output. Each size is run with threads and
+# with -events; the binary defaults to ./homework-q3 and can be given
+# as $1 (e.g. ./homework-q3-qthread).
+#
+# Every run simulates about the same number of customer visits, so
+# events/sec can be compared across sizes. A run that takes longer
+# than LIMIT secs is stopped with SIGINT, which still prints the
+# profile for the part that ran (or is killed 10 secs later, e.g. if
+# it is still creating threads). Results go to bench-q3.dat, and are
+# plotted to bench-q3.png if gnuplot is installed.
+#
+
+BIN=${1:-./homework-q3}
+SIZES=${SIZES:-"10 100 1000 10000 100000"}
+VISITS=${VISITS:-20000}
+LIMIT=${LIMIT:-120}
+OUT=bench-q3.dat
+TMP=/tmp/bench-q3.$$
+
+LD_LIBRARY_PATH=pth-2.0.7/install/lib:$LD_LIBRARY_PATH
+export LD_LIBRARY_PATH
+
+echo "# customers mode events events/sec wall-usecs/sim-sec switches/event notifies/event mean-depth" > $OUT
+for n in $SIZES; do
+    # a customer comes by every 10 simulated secs on average
+    dur=$((VISITS * 10 / n))
+    [ $dur -lt 10 ] && dur=10
+    for mode in threads events; do
+        flag=
+        [ $mode = events ] && flag=-events
+        timeout -s INT -k 10 $LIMIT $BIN $flag -profile -customers $n $dur > $TMP
+        if ! grep -q '^profile:' $TMP ; then
+            echo "$n $mode: no profile" >&2
+            continue
+        fi
+        awk -v n=$n -v mode=$mode '
+            /^profile:/          { ev = $2 }
+            /events\/sec/        { eps = $2 }
+            /wall usecs\/sim/    { us = $4 }
+            /context switches/   { sw = $4; gsub(/[(\/a-z)]/, "", sw) }
+            /condvar notifies/   { nt = $4; gsub(/[(\/a-z)]/, "", nt) }
+            /timer queue depth/  { d = $NF }
+            END { print n, mode, ev, eps, us, sw, nt, d }' $TMP | tee -a $OUT
+    done
+done
+rm -f $TMP
+
+if command -v gnuplot > /dev/null ; then
+    gnuplot <<EOF
+set terminal png size 800,500
+set output "bench-q3.png"
+set logscale xy
+set xlabel "customers"
+set ylabel "events/sec"
+plot "< grep threads $OUT" using 1:4 with linespoints title "threads", \
+     "< grep events $OUT" using 1:4 with linespoints title "events"
+EOF
+    echo "plot in bench-q3.png"
+fi
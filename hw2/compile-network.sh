@@ -0,0 +1,12 @@
+#!/bin/sh
+#
+# The parallel shop-network simulation, see network.c. Plain
+# pthreads, no Pth needed.
+#
+
+if [ x"$1" = xclean ] ; then
+    rm -f network
+    exit
+fi
+
+gcc -O2 -g -Wall -o network network.c -lpthread -lm
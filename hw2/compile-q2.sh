@@ -7,4 +7,4 @@ if [ x"$1" = xclean ] ; then
     exit
 fi
 
-gcc -g -O1 -Wall -o homework-q2 homework.c misc.c -DQ2 -lpthread -lm
+gcc -g -O2 -Wall -o homework-q2 homework.c misc.c -DQ2 -lpthread -lm
@@ -0,0 +1,12 @@
+#!/bin/sh
+#
+# Q3 on top of the hw1 qthreads library instead of GNU Pth, so no
+# build-pth.sh step is needed. qthreads only runs on 32-bit x86.
+#
+
+if [ x"$1" = xclean ] ; then
+    rm -f homework-q3-qthread
+    exit
+fi
+
+gcc -m32 -I ../hw1 -O2 -g -Wall -o homework-q3-qthread misc.c homework.c ../hw1/qthread.c ../hw1/stack.c ../hw1/switch.s -DQ3 -DQTHREAD -lm
@@ -8,4 +8,4 @@ if [ x"$1" = xclean ] ; then
     exit
 fi
 
-gcc -I pth-2.0.7/install/include -g -Wall -o homework-q3 misc.c homework.c -DQ3 -L pth-2.0.7/install/lib -lpth -lm
+gcc -I pth-2.0.7/install/include -O2 -g -Wall -o homework-q3 misc.c homework.c -DQ3 -L pth-2.0.7/install/lib -lpth -lm
@@ -12,31 +12,38 @@
 #include "hw2.h"
 
 void print_barber_sleep(){
+    if (trace_event(TR_BARBER_SLEEP, 0))
+        return;
     printf("DEBUG: %f barber goes to sleep\n", timestamp());
 }
 
 void print_barber_wakes_up(){
+    if (trace_event(TR_BARBER_WAKES, 0))
+        return;
     printf("DEBUG: %f barber wakes up\n", timestamp());
 }
 
 void print_customer_enters_shop(int customer){
+    if (trace_event(TR_ENTERS, customer))
+        return;
     printf("DEBUG: %f customer %d enters shop\n", timestamp(), customer);
 }
 
 void print_customer_starts_haircut(int customer){
+    if (trace_event(TR_STARTS, customer))
+        return;
     printf("DEBUG: %f customer %d starts haircut\n", timestamp(), customer);
 }
 
 void print_customer_leaves_shop(int customer){
+    if (trace_event(TR_LEAVES, customer))
+        return;
     printf("DEBUG: %f customer %d leaves shop\n", timestamp(), customer);
 }
 
 /********** YOUR CODE STARTS HERE ******************/
-#define TIME_OF_HAIRCUT 1.2
 #define TIME_OF_CUSTOMER_CIRCLE 10
-#define NUM_OF_WAIT_CHAIRS 4
 #define NUM_OF_BARBER_CHAIR 1
-#define NUM_OF_CUSTOMERS 10
 #define WAIT_LINE_INITIALIZER { .head = NULL, .tail = NULL, .size = 0 }
 
 /* queue node 
@@ -59,12 +66,18 @@ pthread_cond_t wait_c   = PTHREAD_COND_INITIALIZER; // customers who are waiting
 pthread_cond_t done_c   = PTHREAD_COND_INITIALIZER; // customers who are cutting hair
 wait_line      line     = WAIT_LINE_INITIALIZER;    // wait line of customers
 
+double time_of_haircut = 1.2; // mean haircut time (-haircut)
+int num_of_wait_chairs = 4;   // waiting room size (-chairs)
+int num_of_customers = 10;    // number of customers (-customers)
+
 bool is_sleep    = true; // whether the barber is sleep
-size_t total     = 0;    // total number of customers comes
-size_t turn_away = 0;    // fraction of customer visits result in turning away
+void *frac_turned_away; // fraction of customer visits result in turning away
 void *counter_in_shop;   // average number of customers in the shop
 void *timer_in_shop;     // average time spent in the shop
 void *counter_in_chair;  // fraction of time someone is sitting in the barber's chair 
+void *hist_in_shop;      // distribution of time spent in the shop
+void *hist_customers;    // distribution of number of customers in the shop
+stat_tmr_t *shop_timers;  // per-customer timers for -events
 
 /* get the first customer of the queue
  */
@@ -75,8 +88,9 @@ static int q_poll(wait_line *q) {
     // get first node's index
     int index = q->head->index;
     // delete the node
-    free(q->head);
-    q->head = q->head->next;
+    q_node *head = q->head;
+    q->head = head->next;
+    free(head);
     if (q->head == NULL) {
         q->tail = NULL;
     }
@@ -117,7 +131,7 @@ static void q_offer(wait_line *q, int index) {
  */
 static bool q_full(wait_line *q) {
     return q == NULL ? false : 
-        q->size == NUM_OF_WAIT_CHAIRS + NUM_OF_BARBER_CHAIR;
+        q->size >= num_of_wait_chairs + NUM_OF_BARBER_CHAIR;
 }
 
 /* check whether the waiting queue is empty
@@ -144,7 +158,7 @@ void barber(void) {
         int index = q_peek(&line);
         print_customer_starts_haircut(index);
         stat_count_incr(counter_in_chair);
-        sleep_exp(TIME_OF_HAIRCUT, &m);
+        sleep_exp_from(STREAM_HAIRCUT, time_of_haircut, &m);
 
         // cutting is finished: 
         // customer leaves and signal next waiting customer
@@ -162,10 +176,10 @@ void barber(void) {
  */
 void customer(int customer_num) {
     pthread_mutex_lock(&m);
-    total++;
+    stat_fraction_add(frac_turned_away, q_full(&line));
     if (!q_full(&line)) {
         stat_count_incr(counter_in_shop);
-        stat_timer_start(timer_in_shop);
+        stat_tmr_t in_shop = stat_timer_start(timer_in_shop);
 
         // customer enters and wake up the barber
         if (is_sleep) {
@@ -181,11 +195,9 @@ void customer(int customer_num) {
 
         // wait for hair cut
         pthread_cond_wait(&done_c, &m);
-        stat_timer_stop(timer_in_shop);
-    } else {
-        // shop is full, leave immediately
-        turn_away++;
+        stat_timer_stop(timer_in_shop, in_shop);
     }
+    // otherwise the shop is full, leave immediately
     pthread_mutex_unlock(&m);
 }
 
@@ -195,15 +207,16 @@ void customer(int customer_num) {
  * as that argument instead, using a "cast" to pretend it's a pointer.
  */
 
-/* the customer thread function - create 10 threads, each of which calls
- * this function with its customer number 0..9
+/* the customer thread function - create num_of_customers threads, each
+ * of which calls this function with its customer number 0..N-1
  */
 void *customer_thread(void *context) 
 {
     int customer_num = (int)context; 
     while (true) {
         // simulate customer behavior
-        sleep_exp(TIME_OF_CUSTOMER_CIRCLE, NULL);
+        sleep_exp_from(STREAM_CUSTOMER(customer_num),
+                       TIME_OF_CUSTOMER_CIRCLE, NULL);
         customer(customer_num);
     }
     return context;
@@ -220,14 +233,15 @@ void *barber_thread(void *context)
 void q2(void)
 {
     pthread_t barber_t;
-    pthread_t customers_t[NUM_OF_CUSTOMERS];
+    pthread_t *customers_t = malloc(num_of_customers * sizeof(pthread_t));
 
     pthread_create(&barber_t, NULL, barber_thread, NULL);
-    for (long i = 0; i < NUM_OF_CUSTOMERS; i++) {
+    for (long i = 0; i < num_of_customers; i++) {
         pthread_create(&customers_t[i], NULL, customer_thread, (void *) i);
     }
 
     wait_until_done();
+    free(customers_t);
 }
 
 /* For question 3 you need to measure the following statistics:
@@ -242,35 +256,171 @@ void q2(void)
  * The stat_* functions (counter, timer) are described in the PDF. 
  */
 
-void q3(void)
+/* create the statistics objects
+ */
+static void q3_stats_init(void)
 {
-    // trace stat
+    frac_turned_away = stat_fraction();
     counter_in_shop  = stat_counter();
     timer_in_shop    = stat_timer();
     counter_in_chair = stat_counter();
+    hist_in_shop     = stat_histogram(1e-6);
+    hist_customers   = stat_histogram(1);
+    stat_timer_attach(timer_in_shop, hist_in_shop);
+    stat_count_attach(counter_in_shop, hist_customers);
+}
 
-    // create threads
-    pthread_t barber_t;
-    pthread_t customers_t[NUM_OF_CUSTOMERS];
-
-    pthread_create(&barber_t, NULL, barber_thread, NULL);
-    for (long i = 0; i < NUM_OF_CUSTOMERS; i++) {
-        pthread_create(&customers_t[i], NULL, customer_thread, (void *) i);
-    }
-
-    wait_until_done();
-
+/* print and report the statistics, then free them
+ */
+static void q3_stats(void)
+{
     printf("Fraction of  customer visits result in turning away: %.2f\n", 
-        turn_away / (double) total);
+        stat_fraction_mean(frac_turned_away));
     printf("Average time spent in the shop: %.2f\n", 
         stat_timer_mean(timer_in_shop));
     printf("Average number of customers in the shop: %.2f\n", 
         stat_count_mean(counter_in_shop));
     printf("Fraction of time someone is sitting in the barber's chair: %.2f\n", 
         stat_count_mean(counter_in_chair));
-
+    printf("Time spent in the shop p50/p90/p99/max: %.2f %.2f %.2f %.2f\n",
+        stat_hist_percentile(hist_in_shop, 50),
+        stat_hist_percentile(hist_in_shop, 90),
+        stat_hist_percentile(hist_in_shop, 99),
+        stat_hist_max(hist_in_shop));
+    printf("Customers in the shop p50/p90/p99/max: %.0f %.0f %.0f %.0f\n",
+        stat_hist_percentile(hist_customers, 50),
+        stat_hist_percentile(hist_customers, 90),
+        stat_hist_percentile(hist_customers, 99),
+        stat_hist_max(hist_customers));
+
+    stat_report("turn-away fraction", stat_fraction_mean(frac_turned_away));
+    stat_report("time in shop", stat_timer_mean(timer_in_shop));
+    stat_report("customers in shop", stat_count_mean(counter_in_shop));
+    stat_report("barber chair busy", stat_count_mean(counter_in_chair));
+    stat_report("time in shop p90", stat_hist_percentile(hist_in_shop, 90));
+    stat_report("time in shop p99", stat_hist_percentile(hist_in_shop, 99));
+
+    free(frac_turned_away);
     free(counter_in_shop);
     free(timer_in_shop);
     free(counter_in_chair);
+    free(hist_in_shop);
+    free(hist_customers);
+}
+
+void q3(void)
+{
+    // trace stat
+    q3_stats_init();
+
+    // create threads
+    pthread_t barber_t;
+    pthread_t *customers_t = malloc(num_of_customers * sizeof(pthread_t));
+
+    pthread_create(&barber_t, NULL, barber_thread, NULL);
+    for (long i = 0; i < num_of_customers; i++) {
+        pthread_create(&customers_t[i], NULL, customer_thread, (void *) i);
+    }
+
+    wait_until_done();
+    free(customers_t);
+    q3_stats();
+}
+
+#ifdef Q3
+/* Event-driven versions of barber() and customer() for -events. Each
+ * function runs one step of an entity at the current simulated time
+ * and schedules its next step, instead of blocking a thread. Steps
+ * happen in the same order and make the same random draws as the
+ * threads above, so a given seed gives the same trace and statistics.
+ */
+static void ev_customer_arrive(void *context);
+static void ev_haircut_done(void *context);
+
+/* customer goes back out for TIME_OF_CUSTOMER_CIRCLE
+ */
+static void ev_customer_away(void *context)
+{
+    q3_event_after(1000000 * exp_draw_from(STREAM_CUSTOMER((long) context),
+                                           TIME_OF_CUSTOMER_CIRCLE),
+                   ev_customer_arrive, context);
+}
+
+/* barber starts on the customer at the head of the line
+ */
+static void ev_start_haircut(void)
+{
+    int index = q_peek(&line);
+    print_customer_starts_haircut(index);
+    stat_count_incr(counter_in_chair);
+    q3_event_after(1000000 * exp_draw_from(STREAM_HAIRCUT, time_of_haircut),
+                   ev_haircut_done, NULL);
+}
+
+/* customer's haircut is done and they get up from the chair
+ */
+static void ev_customer_done(void *context)
+{
+    stat_timer_stop(timer_in_shop, shop_timers[(long) context]);
+    ev_customer_away(context);
+}
+
+/* haircut finished: customer leaves, barber takes the next customer
+ * or goes to sleep
+ */
+static void ev_haircut_done(void *context)
+{
+    long index = q_poll(&line);
+    stat_count_decr(counter_in_shop);
+    stat_count_decr(counter_in_chair);
+    print_customer_leaves_shop(index);
+
+    if (q_empty(&line)) {
+        print_barber_sleep();
+        is_sleep = true;
+    } else {
+        ev_start_haircut();
+    }
+    // the customer's own thread would run next, at the same time
+    q3_event_after(0, ev_customer_done, (void *) index);
+}
+
+/* customer arrives: wait in line (waking the barber) or turn away
+ */
+static void ev_customer_arrive(void *context)
+{
+    int customer_num = (long) context;
+    stat_fraction_add(frac_turned_away, q_full(&line));
+    if (!q_full(&line)) {
+        stat_count_incr(counter_in_shop);
+        shop_timers[customer_num] = stat_timer_start(timer_in_shop);
+        q_offer(&line, customer_num);
+        print_customer_enters_shop(customer_num);
+        if (is_sleep) {
+            is_sleep = false;
+            print_barber_wakes_up();
+            ev_start_haircut();
+        }
+    } else {
+        ev_customer_away(context);
+    }
+}
+
+void q3_events(void)
+{
+    // trace stat
+    q3_stats_init();
+
+    // the barber starts out asleep, customers start out away
+    print_barber_sleep();
+    is_sleep = true;
+    shop_timers = calloc(num_of_customers, sizeof(*shop_timers));
+    for (long i = 0; i < num_of_customers; i++) {
+        ev_customer_away((void *) i);
+    }
+
+    q3_event_run();
+    q3_stats();
 }
+#endif  /* Q3 */
 
@@ -16,47 +16,112 @@
 #endif
 
 #ifdef Q3
+#ifdef QTHREAD
+#include "qthread.h"            /* hw1 - see compile-q3-qthread.sh */
+#else
 #include <pth.h>
 #endif
+#endif
 
 /* general functions from misc.c
  */
 extern void sleep_exp(double T, void *m);
+extern double exp_draw(double T);
+
+/* the same, drawing from a separate stream per purpose with -crn
+ */
+#define STREAM_HAIRCUT      0
+#define STREAM_CUSTOMER(i)  (1 + (i))
+extern void sleep_exp_from(int stream, double T, void *m);
+extern double exp_draw_from(int stream, double T);
+extern double unif_draw(void);
 extern double timestamp(void);
 extern void wait_until_done(void);
 
+/* binary event trace (-trace file, read back with -decode file). If
+ * tracing is on, trace_event() records the event and returns true and
+ * the DEBUG line is not printed.
+ */
+enum trace_what {
+    TR_BARBER_SLEEP, TR_BARBER_WAKES, TR_ENTERS, TR_STARTS, TR_LEAVES
+};
+extern int trace_event(int what, int customer);
+
+/* log-bucketed histograms, see misc.c. These work in both Q2 and Q3.
+ */
+extern void *stat_histogram(double unit);
+extern void stat_hist_record(void *hist, double value, double weight);
+extern double stat_hist_percentile(void *hist, double p);
+extern double stat_hist_max(void *hist);
+extern void stat_hist_clear(void *hist);
+
+/* handle for one open stat_timer interval - returned by
+ * stat_timer_start() and passed to stat_timer_stop()
+ */
+typedef struct {
+    double t;                   /* start time */
+} stat_tmr_t;
+
+/* simulation parameters, defined in homework.c so that misc.c can
+ * sweep them from the command line
+ */
+extern double time_of_haircut;
+extern int num_of_wait_chairs;
+extern int num_of_customers;
+
 /* This defines is a Pthreads-compatible simulation system running on
- * top of Pth.
+ * top of Pth, or of the hw1 qthreads library with -DQTHREAD.
  */
 #ifdef Q3
 
+#ifdef QTHREAD
+typedef qthread_t       q3_thread_t;
+typedef qthread_mutex_t q3_mutex_t;
+typedef qthread_cond_t  q3_bcond_t;
+#define Q3_MUTEX_INIT   {.locked = false, .waiters = {NULL, NULL}}
+#define Q3_BCOND_INIT   {.waiters = {NULL, NULL}}
+#else
+typedef pth_t           q3_thread_t;
+typedef pth_mutex_t     q3_mutex_t;
+typedef pth_cond_t      q3_bcond_t;
+#define Q3_MUTEX_INIT   PTH_MUTEX_INIT
+#define Q3_BCOND_INIT   PTH_COND_INIT
+#endif
+
 typedef struct {
     int        waiting;		/* need to track #threads waiting */
-    pth_cond_t cond;            /* see misc.c for details */
+    q3_bcond_t cond;            /* see misc.c for details */
     void      *private;
 } q3_cond_t;
 
 /* functions defined in misc.c
  */
 
-extern int q3_mutex_lock(pth_mutex_t *mutex);
-extern int q3_mutex_unlock(pth_mutex_t *mutex);
+extern int q3_mutex_init(q3_mutex_t *mutex);
+extern int q3_mutex_lock(q3_mutex_t *mutex);
+extern int q3_mutex_unlock(q3_mutex_t *mutex);
 extern int q3_cond_init(q3_cond_t *c);
-extern int q3_cond_wait(q3_cond_t *c, pth_mutex_t *mutex);
+extern int q3_cond_wait(q3_cond_t *c, q3_mutex_t *mutex);
 extern int q3_cond_signal(q3_cond_t *c);
 extern int q3_cond_broadcast(q3_cond_t *c);
-extern int q3_create(pth_t *thread, pth_attr_t attr, 
-                      void *(*start_routine)(void*), void *arg);
+extern int q3_create(q3_thread_t *thread, void *attr,
+                     void *(*start_routine)(void*), void *arg);
+extern int q3_join(q3_thread_t thread, void **val);
 extern int q3_usleep(int);
 
+/* threadless event mode (-events), see misc.c
+ */
+extern void q3_event_after(int usecs, void (*f)(void *), void *ctx);
+extern void q3_event_run(void);
+
 /* define compatible replacements for standard pthread functions 
  */
-#define Q3_COND_INIT {.waiting = 0, .cond = PTH_COND_INIT}
-#define pthread_t pth_t
+#define Q3_COND_INIT {.waiting = 0, .cond = Q3_BCOND_INIT}
+#define pthread_t q3_thread_t
 #define pthread_create(th, attr, f, arg) q3_create(th, attr, f, arg)
-#define pthread_mutex_t pth_mutex_t
-#define PTHREAD_MUTEX_INITIALIZER PTH_MUTEX_INIT
-#define pthread_mutex_init(mutex, attr) pth_mutex_init(mutex)
+#define pthread_mutex_t q3_mutex_t
+#define PTHREAD_MUTEX_INITIALIZER Q3_MUTEX_INIT
+#define pthread_mutex_init(mutex, attr) q3_mutex_init(mutex)
 #define pthread_mutex_lock(m) q3_mutex_lock(m)
 #define pthread_mutex_unlock(m) q3_mutex_unlock(m)
 #define pthread_cond_t q3_cond_t
@@ -65,7 +130,7 @@ extern int q3_usleep(int);
 #define pthread_cond_wait(cond, mutex) q3_cond_wait(cond, mutex)
 #define pthread_cond_signal(cond) q3_cond_signal(cond)
 #define pthread_cond_broadcast(cond) q3_cond_broadcast(cond)
-#define pthread_join(thr, vptr) pth_join(thr, vptr)
+#define pthread_join(thr, vptr) q3_join(thr, vptr)
 #define usleep(n) q3_usleep(n)
 
 #endif  /* Q3 */
@@ -78,9 +143,16 @@ extern void stat_count_incr(void *ctr);
 extern void stat_count_decr(void *ctr);
 extern double stat_count_mean(void *ctr);
 extern void *stat_timer(void);
-extern void stat_timer_start(void *tmr);
-extern void stat_timer_stop(void *tmr);
+extern stat_tmr_t stat_timer_start(void *tmr);
+extern void stat_timer_stop(void *tmr, stat_tmr_t h);
 extern double stat_timer_mean(void *tmr);
+extern void *stat_fraction(void);
+extern void stat_fraction_add(void *frac, int hit);
+extern double stat_fraction_mean(void *frac);
+extern void stat_reset(void);
+extern void stat_count_attach(void *ctr, void *hist);
+extern void stat_timer_attach(void *tmr, void *hist);
+extern void stat_report(char *name, double value);
 #endif  /* Q3 */
 
 #ifdef Q2
@@ -92,9 +164,16 @@ static inline void stat_count_incr(void *ctr){}
 static inline void stat_count_decr(void *ctr){}
 static inline double stat_count_mean(void *ctr){return 0.0;}
 static inline void *stat_timer(void){return NULL;}
-static inline void stat_timer_start(void *tmr){}
-static inline void stat_timer_stop(void *tmr){}
+static inline stat_tmr_t stat_timer_start(void *tmr){stat_tmr_t h = {0}; return h;}
+static inline void stat_timer_stop(void *tmr, stat_tmr_t h){}
 static inline double stat_timer_mean(void *tmr){return 0.0;}
+static inline void *stat_fraction(void){return NULL;}
+static inline void stat_fraction_add(void *frac, int hit){}
+static inline double stat_fraction_mean(void *frac){return 0.0;}
+static inline void stat_reset(void){}
+static inline void stat_count_attach(void *ctr, void *hist){}
+static inline void stat_timer_attach(void *tmr, void *hist){}
+static inline void stat_report(char *name, double value){}
 #endif  /* Q2 */
 
 #endif  /* __HW2_H__ */
@@ -11,17 +11,192 @@
 #include <signal.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <math.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "hw2.h"
 
 void q2(void);
 void q3(void);
+void q3_events(void);
 
 int    end_time = 0;
 double speedup = 1.0;
 double t0;
 
+/* Random number state for sleep_exp(). This is the same 48-bit
+ * generator as drand48(), but kept in a variable so that each
+ * replication can be given its own stream.
+ */
+unsigned short rng_state[3];
+
+/* With -rng xoshiro, samples come from xoshiro256+ instead, and
+ * exponential variates are made EXP_BATCH at a time (see exp_refill).
+ * This gives different streams than drand48, so it is not the default.
+ */
+#define EXP_BATCH 256
+
+int rng_xoshiro;
+static struct {
+    uint64_t s[4];              /* xoshiro256+ state */
+    int      seeded;
+    int      pos;               /* next unused entry in exp[] */
+    double   exp[EXP_BATCH];    /* unit-mean exponential variates */
+} xo = {.pos = EXP_BATCH};
+
+/* In Q2 the customers draw their arrival times on their own threads,
+ * without the shop mutex, so the shared streams need a lock of their
+ * own. Q3 threads never run at the same time.
+ */
+#ifdef Q2
+static pthread_mutex_t rng_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define RNG_LOCK()   pthread_mutex_lock(&rng_mutex)
+#define RNG_UNLOCK() pthread_mutex_unlock(&rng_mutex)
+#else
+#define RNG_LOCK()
+#define RNG_UNLOCK()
+#endif
+
+/* Variance reduction. With -crn every stream number (see hw2.h) gets
+ * its own drand48 stream (or xoshiro256+ stream with -rng xoshiro,
+ * drawn one at a time rather than batched), seeded from the run's
+ * seed and the stream number, so that two configurations run with the
+ * same seed see the same arrivals and the same haircuts even once
+ * their event orders diverge. Streams are set up the first time they
+ * are used, under the Q2 lock like the shared stream.
+ *
+ * 'flip' is set for the second run of an -antithetic pair: every
+ * uniform u is replaced by 1-u, so long draws become short ones.
+ */
+int crn, antithetic;
+static int flip;
+static long crn_seed;
+static struct crn_state {
+    unsigned short rng[3];      /* drand48 */
+    uint64_t       xo[4];       /* xoshiro256+ */
+} *crn_state;
+static int crn_n, crn_max;
+
+/* splitmix64, to spread a small seed over the xoshiro state
+ */
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* seed the stream exactly as srand48(seed) would seed drand48(), and
+ * the xoshiro stream from the same seed
+ */
+static void rng_seed(long seed)
+{
+    uint64_t x = seed;
+    int i;
+    rng_state[0] = 0x330E;
+    rng_state[1] = seed & 0xFFFF;
+    rng_state[2] = (seed >> 16) & 0xFFFF;
+    for (i = 0; i < 4; i++)
+        xo.s[i] = splitmix64(&x);
+    xo.seeded = 1;
+    xo.pos = EXP_BATCH;         /* drop variates from the old stream */
+    crn_seed = seed;
+    crn_n = 0;                  /* and reseed the -crn streams */
+}
+
+static struct crn_state *crn_stream(int stream)
+{
+    while (stream >= crn_n) {
+        if (crn_n == crn_max) {
+            crn_max = crn_max ? 2 * crn_max : 64;
+            crn_state = realloc(crn_state, crn_max * sizeof(*crn_state));
+            assert(crn_state != NULL);
+        }
+        uint64_t x = crn_seed * 0x100000001B3ULL + crn_n;
+        uint64_t v = splitmix64(&x);
+        crn_state[crn_n].rng[0] = v & 0xFFFF;
+        crn_state[crn_n].rng[1] = (v >> 16) & 0xFFFF;
+        crn_state[crn_n].rng[2] = (v >> 32) & 0xFFFF;
+        for (int i = 0; i < 4; i++)
+            crn_state[crn_n].xo[i] = splitmix64(&x);
+        crn_n++;
+    }
+    return &crn_state[stream];
+}
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t xoshiro256p(uint64_t *s)
+{
+    uint64_t r = s[0] + s[3], t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return r;
+}
+
+/* Refill xo.exp[] with -log(u) for EXP_BATCH uniforms u in (0,1].
+ *
+ * The log is computed without libm, in a loop of plain 64-bit integer
+ * and double arithmetic - no calls, compares or int/double casts - so
+ * that gcc -O2 vectorizes it (the compile scripts use -O2): u = m * 2^e
+ * with m in [sqrt(1/2), sqrt(2)), then log(m) = 2 atanh(z),
+ * z = (m-1)/(m+1), summed as 2(z + z^3/3 + ... + z^9/9). |z| <= 0.1716,
+ * so the terms left off add up to less than 7.2e-10; with rounding the
+ * result is within 1e-9 of -log(u) (absolute). For an exponential
+ * with mean T that is 1e-9 T, well under the microsecond the
+ * simulator rounds sleeps to for any T below 1000 secs.
+ */
+#define MANT_MASK  0x000FFFFFFFFFFFFFULL
+#define SQRT2_MANT 0x0006A09E667F3BCDULL   /* mantissa bits of sqrt(2) */
+#define EXP_BIAS   0x4330000000000000ULL   /* 2^52 as a double */
+
+static void exp_refill(void)
+{
+    uint64_t u[EXP_BATCH];
+    int i;
+
+    if (!xo.seeded)
+        rng_seed(0);
+    for (i = 0; i < EXP_BATCH; i++) {
+        uint64_t k = xoshiro256p(xo.s) >> 11;
+        if (flip)
+            k = (1ULL << 53) - 1 - k;
+        double d = (k + 1) * 0x1.0p-53;
+        memcpy(&u[i], &d, sizeof(d));
+    }
+
+    for (i = 0; i < EXP_BATCH; i++) {
+        uint64_t bits = u[i], mant = bits & MANT_MASK;
+        uint64_t big = (SQRT2_MANT - mant) >> 63;   /* 1 if m > sqrt(2) */
+        /* m = mantissa with exponent 0, or -1 if big; e = 2048 + exponent
+         * of u (+1 if big), turned into a double by the 2^52 trick */
+        uint64_t mbits = mant | ((0x3FFULL - big) << 52);
+        uint64_t ebits = EXP_BIAS | ((bits >> 52) + 1025 + big);
+        double m, e;
+        memcpy(&m, &mbits, sizeof(m));
+        memcpy(&e, &ebits, sizeof(e));
+        e -= 0x1.0p52 + 2048;
+        double z = (m - 1) / (m + 1), z2 = z * z;
+        double lg = 2 * z * (1 + z2 * (1.0/3 + z2 * (1.0/5 + z2 *
+                                      (1.0/7 + z2 * (1.0/9)))));
+        xo.exp[i] = -(lg + e * M_LN2);
+    }
+    xo.pos = 0;
+}
+
 /* some definitions from hw2.h
  */
 #ifdef Q3
@@ -40,65 +215,532 @@ static void handler(int sig)
     done = 1;
 }
 
+/* exp_draw(T) - exponentially distributed time with mean T secs
+ */
+double exp_draw(double T)
+{
+    double x;
+    RNG_LOCK();
+    if (rng_xoshiro) {
+        if (xo.pos >= EXP_BATCH)
+            exp_refill();
+        x = T * xo.exp[xo.pos++];
+    } else {
+        double u = erand48(rng_state);
+        x = -1 * T * log(flip ? 1 - u : u);
+    }
+    RNG_UNLOCK();
+    return x;
+}
+
+/* exp_draw_from(stream, T) - the same, from one of the -crn streams.
+ * Without -crn, or for a negative stream, this is just exp_draw(T).
+ */
+double exp_draw_from(int stream, double T)
+{
+    if (!crn || stream < 0)
+        return exp_draw(T);
+    double u;
+    RNG_LOCK();                 /* crn_stream() may move the array */
+    struct crn_state *cs = crn_stream(stream);
+    if (rng_xoshiro) {
+        uint64_t k = xoshiro256p(cs->xo) >> 11;
+        if (flip)
+            k = (1ULL << 53) - 1 - k;
+        u = (k + 1) * 0x1.0p-53;
+    } else {
+        u = erand48(cs->rng);
+        u = flip ? 1 - u : u;
+    }
+    RNG_UNLOCK();
+    return -1 * T * log(u);
+}
+
+/* uniform on [0,1) from the current stream, for other distributions
+ * ((0,1] in the second run of an antithetic pair)
+ */
+double unif_draw(void)
+{
+    double u;
+    RNG_LOCK();
+    if (rng_xoshiro) {
+        if (!xo.seeded)
+            rng_seed(0);
+        u = (xoshiro256p(xo.s) >> 11) * 0x1.0p-53;
+    } else
+        u = erand48(rng_state);
+    RNG_UNLOCK();
+    return flip ? 1 - u : u;
+}
+
+/* Histograms. Values are counted in log-spaced buckets, HDR style:
+ * each power of two is split into HIST_SUB linear sub-buckets, so a
+ * recorded value is known to within 1/HIST_SUB (about 3%) of itself,
+ * or to within 'unit' for values below HIST_SUB units. Recording is
+ * O(1) and the memory is fixed no matter how many samples are seen;
+ * percentiles are found by walking the buckets at the end.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct stat_hist {
+    double unit;                /* resolution of the smallest buckets */
+    double total;               /* sum of all weights */
+    double max;                 /* largest value recorded */
+    double w[HIST_BUCKETS];     /* weight recorded in each bucket */
+};
+
+/* Create a new histogram with the given resolution. Free it using free()
+ */
+void *stat_histogram(double unit)
+{
+    struct stat_hist *h = calloc(sizeof(*h), 1);
+    h->unit = unit;
+    return h;
+}
+
+static int hist_index(uint64_t v)
+{
+    if (v < HIST_SUB)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)(v >> shift) - HIST_SUB;
+}
+
+/* midpoint of a bucket, in units
+ */
+static double hist_value(int i)
+{
+    int b = i / HIST_SUB, s = i % HIST_SUB;
+    if (b < 2)
+        return b * HIST_SUB + s;
+    return ldexp(HIST_SUB + s + 0.5, b - 1);
+}
+
+/* Record a value. The weight is 1 for a plain sample; counters use
+ * the length of time the value was held.
+ */
+void stat_hist_record(void *hist, double value, double weight)
+{
+    struct stat_hist *h = hist;
+    double v = value / h->unit;
+    if (weight <= 0)
+        return;
+    if (v < 0)
+        v = 0;
+    if (v > 1.8e19)             /* top of uint64_t */
+        v = 1.8e19;
+    h->w[hist_index((uint64_t)v)] += weight;
+    h->total += weight;
+    if (value > h->max)
+        h->max = value;
+}
+
+/* Empty a histogram
+ */
+void stat_hist_clear(void *hist)
+{
+    struct stat_hist *h = hist;
+    memset(h->w, 0, sizeof(h->w));
+    h->total = h->max = 0;
+}
+
+/* Value below which p percent of the recorded weight falls
+ */
+double stat_hist_percentile(void *hist, double p)
+{
+    struct stat_hist *h = hist;
+    double target = h->total * p / 100, sum = 0;
+    int i;
+    for (i = 0; i < HIST_BUCKETS - 1; i++) {
+        sum += h->w[i];
+        if (sum > 0 && sum >= target)
+            break;
+    }
+    double v = hist_value(i) * h->unit;
+    return v < h->max ? v : h->max;
+}
+
+/* Largest value recorded - exact, not bucketed
+ */
+double stat_hist_max(void *hist)
+{
+    struct stat_hist *h = hist;
+    return h->max;
+}
+
+/* Binary trace. With -trace FILE each DEBUG event is stored as a
+ * fixed-size record in a buffer, which is written out with one large
+ * write() when it fills and at exit - no formatting on the hot path.
+ * -decode FILE prints a trace back in the DEBUG text format, so
+ * q2test.py can read it. Callers must be serialized; homework.c only
+ * prints with its mutex held.
+ */
+#define TRACE_RECS 4096         /* 64KB buffer */
+
+struct trace_rec {
+    double  t;
+    int32_t what;               /* enum trace_what */
+    int32_t customer;
+};
+
+static int trace_fd = -1;
+static struct trace_rec trace_buf[TRACE_RECS];
+static int trace_n;
+
+static char *trace_fmt[] = {
+    [TR_BARBER_SLEEP] = "DEBUG: %f barber goes to sleep\n",
+    [TR_BARBER_WAKES] = "DEBUG: %f barber wakes up\n",
+    [TR_ENTERS]       = "DEBUG: %f customer %d enters shop\n",
+    [TR_STARTS]       = "DEBUG: %f customer %d starts haircut\n",
+    [TR_LEAVES]       = "DEBUG: %f customer %d leaves shop\n",
+};
+
+static void trace_flush(void)
+{
+    size_t len = trace_n * sizeof(struct trace_rec);
+    if (trace_fd >= 0 && trace_n > 0 && write(trace_fd, trace_buf, len) != len)
+        perror("trace");
+    trace_n = 0;
+}
+
+static void trace_open(char *file)
+{
+    trace_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (trace_fd < 0) {
+        perror(file);
+        exit(1);
+    }
+    atexit(trace_flush);
+}
+
+int trace_event(int what, int customer)
+{
+    if (trace_fd < 0)
+        return 0;
+    trace_buf[trace_n].t = timestamp();
+    trace_buf[trace_n].what = what;
+    trace_buf[trace_n].customer = customer;
+    if (++trace_n == TRACE_RECS)
+        trace_flush();
+    return 1;
+}
+
+/* print a binary trace as DEBUG lines
+ */
+static void trace_decode(char *file)
+{
+    int fd = open(file, O_RDONLY), i, n;
+    if (fd < 0) {
+        perror(file);
+        exit(1);
+    }
+    while ((n = read(fd, trace_buf, sizeof(trace_buf))) > 0) {
+        for (i = 0; i < n / (int)sizeof(struct trace_rec); i++) {
+            struct trace_rec *r = &trace_buf[i];
+            if (r->what < 0 || r->what > TR_LEAVES) {
+                fprintf(stderr, "%s: bad record\n", file);
+                exit(1);
+            }
+            printf(trace_fmt[r->what], r->t, r->customer);
+        }
+    }
+    close(fd);
+}
+
 #ifdef Q2
+#include <pthread.h>
+
+/* Time in Q2 is CLOCK_MONOTONIC, so that it can't be stepped by NTP
+ * or the date command, and every sleep is to an absolute deadline
+ * rather than for an interval - the time lost between computing
+ * the interval and going to sleep doesn't add up over a run.
+ */
+static pthread_cond_t sleep_cond;   /* never signalled, see sleep_exp() */
+
+static double mono_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1.0e9;
+}
+
+/* absolute CLOCK_MONOTONIC time for timestamp() value t
+ */
+static struct timespec deadline(double t)
+{
+    double d = t0 + t;
+    struct timespec ts = {.tv_sec = (time_t)d};
+    ts.tv_nsec = (d - ts.tv_sec) * 1.0e9;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
 static void init_time(void)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    t0 = tv.tv_sec + tv.tv_usec/1.0e6;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sleep_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    t0 = mono_time();
 }
 
 /* timestamp - time since start - NOT adjusted for speedup
  */
 double timestamp(void)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    double t1 = tv.tv_sec + tv.tv_usec/1.0e6;
-    return (t1-t0);
+    return mono_time() - t0;
+}
+
+/* Lateness: how far past its deadline each sleep_exp() actually got
+ * going again (including getting its mutex back), in real time. If
+ * this is a noticeable fraction of the simulated times once scaled by
+ * -speedup, the run isn't following the model any more.
+ */
+static pthread_mutex_t late_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void *hist_late;
+
+static void late_record(double late)
+{
+    pthread_mutex_lock(&late_mutex);
+    if (hist_late == NULL)
+        hist_late = stat_histogram(1e-6);
+    stat_hist_record(hist_late, late > 0 ? late : 0, 1);
+    pthread_mutex_unlock(&late_mutex);
+}
+
+/* fold the buckets of h into powers of two: oct[0] is everything
+ * below one unit, oct[k] is [2^(k-1), 2^k) units
+ */
+#define HIST_OCTAVES 66
+static void hist_octaves(struct stat_hist *h, double oct[HIST_OCTAVES])
+{
+    int i;
+    memset(oct, 0, HIST_OCTAVES * sizeof(double));
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        int b = i / HIST_SUB, s = i % HIST_SUB;
+        double low = b < 2 ? i : ldexp(HIST_SUB + s, b - 1);
+        oct[low < 1 ? 0 : ilogb(low) + 1] += h->w[i];
+    }
+}
+
+static void late_report(void)
+{
+    static const double pct[] = {50, 90, 99, 99.9};
+    double p[4], max, total, oct[HIST_OCTAVES];
+    int i, k;
+
+    pthread_mutex_lock(&late_mutex);
+    if (hist_late == NULL) {
+        pthread_mutex_unlock(&late_mutex);
+        return;
+    }
+    for (i = 0; i < 4; i++)
+        p[i] = stat_hist_percentile(hist_late, pct[i]);
+    max = stat_hist_max(hist_late);
+    total = ((struct stat_hist *)hist_late)->total;
+    hist_octaves(hist_late, oct);
+    pthread_mutex_unlock(&late_mutex);
+
+    printf("Wake-up lateness p50/p90/p99/p99.9/max: "
+           "%.0f %.0f %.0f %.0f %.0f usecs\n",
+           p[0]*1e6, p[1]*1e6, p[2]*1e6, p[3]*1e6, max*1e6);
+    printf("  in simulated time: %.4f %.4f %.4f %.4f %.4f secs\n",
+           p[0]*speedup, p[1]*speedup, p[2]*speedup, p[3]*speedup,
+           max*speedup);
+
+    /* the shape: one line per power of two that saw any wake-ups */
+    printf("  %21s %10s\n", "lateness (usecs)", "wake-ups");
+    for (k = 0; k < HIST_OCTAVES; k++) {
+        if (oct[k] == 0)
+            continue;
+        if (k == 0)
+            printf("  %21s", "< 1 usecs");
+        else
+            printf("  [%8.0f, %8.0f)", ldexp(1, k - 1), ldexp(1, k));
+        printf(" %10.0f %5.1f%%\n", oct[k], 100 * oct[k] / total);
+    }
+
+    if (p[2] * speedup > 0.01 * time_of_haircut)
+        printf("WARNING: p99 lateness is over 1%% of a haircut, "
+               "results at speedup %.2f are not reliable\n", speedup);
 }
 
-/* wait until simulation end or ^C
+/* wait until simulation end or ^C. SIGINT may be delivered to any
+ * thread, so check 'done' at least every 100ms. (Not a timed wait on
+ * sleep_cond: the barber waits on it with the shop's mutex, and all
+ * waiters on a condvar have to use the same one. Customers sleep with
+ * no mutex, in clock_nanosleep.)
  */
 void wait_until_done(void)
 {
-    while (!done && (!end_time || timestamp() < end_time / speedup))
-        usleep(100000);
+    double end = end_time ? end_time / speedup : INFINITY;
+
+    while (!done && timestamp() < end) {
+        struct timespec ts = deadline(fmin(end, timestamp() + 0.1));
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
 }
 
 /* sleep_exp(T) - sleep for exp. dist. time with mean T secs
  *                unlocks mutex while sleeping if provided.
  */
-#include <pthread.h>
-
 void sleep_exp(double T, void *m)
 {
-    double t = -1 * T * log(drand48()); /* sleep time */
+    sleep_exp_from(-1, T, m);
+}
+
+void sleep_exp_from(int stream, double T, void *m)
+{
+    double t = exp_draw_from(stream, T); /* sleep time */
     if (t > T*10)
         t = T*10;
     if (t < 0.002 * speedup)
         t = 0.002 * speedup;
-    if (m != NULL)
-        pthread_mutex_unlock(m);
-    usleep(1000000 * t / speedup);
-    if (m != NULL)
-        pthread_mutex_lock(m);
+
+    double due = timestamp() + t / speedup;
+    struct timespec ts = deadline(due);
+    if (m != NULL) {
+        /* drops m until the deadline, like unlock/sleep/lock */
+        while (pthread_cond_timedwait(&sleep_cond, m, &ts) != ETIMEDOUT)
+            ;
+    } else {
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                               NULL) == EINTR)
+            ;
+    }
+    late_record(timestamp() - due);
 }
 
 #endif
 
 #ifdef Q3
-#include "hw2.h"
+
+/* Kernel profile (-profile). The counters are always kept, since an
+ * increment costs next to nothing; -profile just prints them at exit.
+ */
+int profile;
+static struct {
+    unsigned long events;       /* timer expirations - sleeps and callbacks */
+    unsigned long fast;         /* sleeps that never touched the queue */
+    unsigned long switches;     /* times a thread blocked in th_wait() */
+    unsigned long notifies;     /* th_notify() calls */
+    unsigned long pushes, pops; /* timer queue operations */
+    unsigned long depth_sum;    /* queue length summed over pushes */
+    int           depth_max;
+    double        wall0;        /* wall clock at start of run */
+} prof;
+
+static double wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1.0e9;
+}
+
+/* Thread primitives. The simulation runs on GNU Pth by default, or on
+ * the hw1 qthreads library when built with -DQTHREAD (see
+ * compile-q3-qthread.sh); everything below goes through these.
+ */
+#ifdef QTHREAD
+static void th_lock(q3_mutex_t *m)
+{
+    qthread_mutex_lock(m);
+}
+static void th_unlock(q3_mutex_t *m)
+{
+    qthread_mutex_unlock(m);
+}
+static void th_wait(q3_bcond_t *c, q3_mutex_t *m)
+{
+    prof.switches++;
+    qthread_cond_wait(c, m);
+}
+static void th_notify(q3_bcond_t *c, int all)
+{
+    prof.notifies++;
+    if (all)
+        qthread_cond_broadcast(c);
+    else
+        qthread_cond_signal(c);
+}
+static q3_thread_t th_spawn(void *attr, void *(*f)(void*), void *arg)
+{
+    return qthread_create(f, arg);
+}
+static void *th_join(q3_thread_t th)
+{
+    return qthread_join(th);
+}
+
+/* The simulated threads never exit, so qthread_run() would never
+ * return - end the process when the simulation is done instead.
+ */
+static void *q3_thread(void *arg)
+{
+    q3();
+    exit(0);
+}
+static void th_run_q3(void)
+{
+    qthread_create(q3_thread, NULL);
+    qthread_run();
+}
+#else
+static void th_lock(q3_mutex_t *m)
+{
+    pth_mutex_acquire(m, FALSE, NULL);
+}
+static void th_unlock(q3_mutex_t *m)
+{
+    pth_mutex_release(m);
+}
+static void th_wait(q3_bcond_t *c, q3_mutex_t *m)
+{
+    prof.switches++;
+    pth_cond_await(c, m, NULL);
+}
+static void th_notify(q3_bcond_t *c, int all)
+{
+    prof.notifies++;
+    pth_cond_notify(c, all);
+}
+static q3_thread_t th_spawn(void *attr, void *(*f)(void*), void *arg)
+{
+    return pth_spawn(attr, f, arg);
+}
+static void *th_join(q3_thread_t th)
+{
+    void *val = NULL;
+    pth_join(th, &val);
+    return val;
+}
+static void th_run_q3(void)
+{
+    pth_init();
+    q3();
+}
+#endif
 
 void sleep_exp(double T, void *m)
 {
-    double t = -1 * T * log(drand48()); /* sleep time */
+    sleep_exp_from(-1, T, m);
+}
+
+void sleep_exp_from(int stream, double T, void *m)
+{
+    double t = exp_draw_from(stream, T); /* sleep time */
 
     if (m != NULL)
-        pth_mutex_release(m);
+        th_unlock(m);
     usleep(1000000 * t);
     if (m != NULL)
-        pth_mutex_acquire(m, FALSE, NULL);
+        th_lock(m);
 }
 
 /* Thread book-keeping. We need to keep track of how many runnable
@@ -114,37 +756,76 @@ double timestamp(void)
     return now;
 }
 
-/* Wait structures. These form a doubly-linked list, sorted by
- * increasing expiration time. The thread is waiting to be signalled
- * with SIGUSR1.
+/* Wait structures. Sleeping threads sit in a binary min-heap ordered
+ * by expiration time, so that a simulated sleep costs O(log N) rather
+ * than a scan of every pending event. The thread is waiting to be
+ * signalled on its condition variable.
  */
 struct q3_wait {
-    pth_t        th;            /* sleeping thread */
     double       t;             /* expiration time */
-    struct q3_wait *prev, *next;
-    pth_cond_t   cond;
+    unsigned long seq;          /* insertion order, for ties */
+    q3_bcond_t   cond;
     int          done;
+    void       (*fn)(void *);   /* event mode - callback and its */
+    void        *ctx;           /* argument, see q3_event_after() */
+    struct q3_wait *next;       /* free list */
 };
-static struct q3_wait waitq = {.next = &waitq, .prev = &waitq};
-static pth_mutex_t wait_mutex = PTH_MUTEX_INIT;
+static struct q3_wait **waitq;  /* heap - waitq[0] expires first */
+static int waitq_len, waitq_max;
+static unsigned long waitq_seq;
+static q3_mutex_t wait_mutex = Q3_MUTEX_INIT;
+
+/* Heap ordering. Equal timestamps are broken by insertion order, the
+ * later sleeper first - the same order the old sorted list gave, so
+ * a given seed still produces the same trace.
+ */
+static int wait_before(struct q3_wait *a, struct q3_wait *b)
+{
+    if (a->t != b->t)
+        return a->t < b->t;
+    return a->seq > b->seq;
+}
 
-/* List manipulation functions. 
+/* Heap manipulation functions.
  */
-static void insert_before(struct q3_wait *next, struct q3_wait *this)
+static void heap_push(struct q3_wait *w)
 {
-    this->next = next;
-    this->prev = next->prev;
-    next->prev->next = this;
-    next->prev = this;
+    int i, parent;
+    if (waitq_len == waitq_max) {
+        waitq_max = waitq_max ? 2 * waitq_max : 64;
+        waitq = realloc(waitq, waitq_max * sizeof(*waitq));
+        assert(waitq != NULL);
+    }
+    w->seq = waitq_seq++;
+    prof.pushes++;
+    prof.depth_sum += waitq_len;
+    if (waitq_len >= prof.depth_max)
+        prof.depth_max = waitq_len + 1;
+    for (i = waitq_len++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (!wait_before(w, waitq[parent]))
+            break;
+        waitq[i] = waitq[parent];
+    }
+    waitq[i] = w;
 }
-static struct q3_wait *remove_after(struct q3_wait *p)
+static struct q3_wait *heap_pop(void)
 {
-    if (p->prev == p)
+    int i, child;
+    if (waitq_len == 0)
         return NULL;
-    struct q3_wait *w = p->next;
-    p->next = w->next;
-    p->next->prev = w->prev;
-    return w;
+    prof.pops++;
+    struct q3_wait *top = waitq[0];
+    struct q3_wait *last = waitq[--waitq_len];
+    for (i = 0; (child = 2*i + 1) < waitq_len; i = child) {
+        if (child + 1 < waitq_len && wait_before(waitq[child+1], waitq[child]))
+            child++;
+        if (!wait_before(waitq[child], last))
+            break;
+        waitq[i] = waitq[child];
+    }
+    waitq[i] = last;
+    return top;
 }
 
 /* Wake the first thread from the timer queue and jump simulation time
@@ -152,11 +833,11 @@ static struct q3_wait *remove_after(struct q3_wait *p)
  */
 static void q3_wake_next(struct q3_wait *self)
 {
-    struct q3_wait *next = remove_after(&waitq);
+    struct q3_wait *next = heap_pop();
     now = next->t;
     next->done = 1;
     nthreads++;
-    pth_cond_notify(&next->cond, FALSE);
+    th_notify(&next->cond, 0);
 }
 
 /* Go to sleep on the timer queue for N simulated microseconds
@@ -164,22 +845,16 @@ static void q3_wake_next(struct q3_wait *self)
 int q3_usleep(int usecs)
 {
     double t = usecs / 1000000.0;
-    struct q3_wait w = {.th = pth_self(), .t = now+t, .done = 0,
-			.cond = PTH_COND_INIT};
-    struct q3_wait *p;
+    struct q3_wait w = {.t = now+t, .done = 0, .cond = Q3_BCOND_INIT};
 
-    /* Find our position in the sorted list. This is where
-     * doubly-linked lists are nice - you don't have to worry about
-     * corner conditions at the head and tail.
-     */
-    for (p = waitq.next; p != &waitq && p->t < w.t; )
-        p = p->next;
+    prof.events++;
 
     /* If we're the last thread, then either we'll be the next one and
      * have to return, or we need to release the first thread before
-     * we go to sleep.
+     * we go to sleep. (on a tie we'd be woken first, see wait_before)
      */
-    if (nthreads == 1 && p->prev == &waitq) {
+    if (nthreads == 1 && (waitq_len == 0 || w.t <= waitq[0]->t)) {
+	prof.fast++;
 	now = w.t;
 	return 0;
     }
@@ -187,34 +862,125 @@ int q3_usleep(int usecs)
     /* Insert ourselves in the timer queue and go to sleep. All timer
      * queue and sleep/wakeup operations are protected by wait_mutex.
      */
-    pth_mutex_acquire(&wait_mutex, FALSE, NULL);
+    th_lock(&wait_mutex);
 
-    insert_before(p, &w);
+    heap_push(&w);
     nthreads--;
     if (nthreads == 0)
 	q3_wake_next(&w);
 
     while (!w.done)
-	pth_cond_await(&w.cond, &wait_mutex, NULL);
+	th_wait(&w.cond, &wait_mutex);
 
-    pth_mutex_release(&wait_mutex);
+    th_unlock(&wait_mutex);
 
     return 0;
 }
 
+/* Event mode (-events). Instead of a thread per entity, homework.c
+ * schedules plain callbacks on the same timer queue and then calls
+ * q3_event_run(), which pops them in time order. There are no Pth
+ * threads, mutexes or condition variables involved - each event
+ * costs one heap push and pop.
+ */
+int event_mode;
+static struct q3_wait *free_events;
+
+/* Run f(ctx) N simulated microseconds from now. Like q3_usleep the
+ * delay is an integer, so usleep(x) and q3_event_after(x, ...) land
+ * on exactly the same time.
+ */
+void q3_event_after(int usecs, void (*f)(void *), void *ctx)
+{
+    struct q3_wait *e = free_events;
+    if (e != NULL)
+        free_events = e->next;
+    else
+        e = malloc(sizeof(*e));
+    e->t = now + usecs / 1000000.0;
+    e->fn = f;
+    e->ctx = ctx;
+    heap_push(e);
+}
+
+static int converged(void);
+static void warm_branch(void);
+double warmup;                  /* -warmup, see warm_branch() */
+static int branched;
+
+/* Run events until the end of the simulation or ^C. This stops at
+ * the same point wait_until_done() would, i.e. the first whole
+ * second past end_time.
+ */
+void q3_event_run(void)
+{
+    double stop = end_time + 1;
+    struct q3_wait *e;
+
+    while (!done && waitq_len > 0) {
+        if (end_time > 0 && waitq[0]->t > stop)
+            break;
+        if (warmup > 0 && waitq[0]->t > warmup && !branched) {
+            now = warmup;
+            warm_branch();
+        }
+        if (converged())
+            return;
+        e = heap_pop();
+        now = e->t;
+        prof.events++;
+        e->fn(e->ctx);
+        e->next = free_events;
+        free_events = e;
+    }
+    if (end_time > 0 && !done)
+        now = stop;
+}
+
+/* print the kernel profile, from atexit() with -profile
+ */
+static void prof_report(void)
+{
+    double wall = wall_time() - prof.wall0;
+    double ev = prof.events > 0 ? prof.events : 1;
+
+    printf("profile: %lu events in %.0f simulated secs, %.3f wall secs\n",
+           prof.events, now, wall);
+    printf("  events/sec             %.0f\n", prof.events / wall);
+    printf("  wall usecs/sim sec     %.3f\n", now > 0 ? 1e6 * wall / now : 0);
+    printf("  context switches       %lu (%.2f/event)\n",
+           prof.switches, prof.switches / ev);
+    printf("  condvar notifies       %lu (%.2f/event)\n",
+           prof.notifies, prof.notifies / ev);
+    printf("  timer queue push/pop   %lu %lu (%lu sleeps skipped it)\n",
+           prof.pushes, prof.pops, prof.fast);
+    printf("  timer queue depth      max %d, mean %.1f\n", prof.depth_max,
+           prof.pushes > 0 ? (double)prof.depth_sum / prof.pushes : 0);
+    fflush(stdout);
+}
+
 /* Wrapper functions for mutexes. For a more general simulator we
  * would probably want to track the number of threads waiting on a
  * mutex, like we do for condvars. For monitor-structured code this
  * isn't an issue.
  */
-int q3_mutex_lock(pth_mutex_t *mutex)
+int q3_mutex_init(q3_mutex_t *mutex)
+{
+    q3_mutex_t init = Q3_MUTEX_INIT;
+    *mutex = init;
+    return 0;
+}
+
+int q3_mutex_lock(q3_mutex_t *mutex)
 {
-    return pth_mutex_acquire(mutex, FALSE, NULL);
+    th_lock(mutex);
+    return 0;
 }
 
-int q3_mutex_unlock(pth_mutex_t *mutex)
+int q3_mutex_unlock(q3_mutex_t *mutex)
 {
-    return pth_mutex_release(mutex);
+    th_unlock(mutex);
+    return 0;
 }
 
 /* Wrapper functions for condition variables. Note that we keep track
@@ -224,8 +990,10 @@ int q3_mutex_unlock(pth_mutex_t *mutex)
  */
 int q3_cond_init(q3_cond_t *c)
 {
+    q3_bcond_t init = Q3_BCOND_INIT;
     c->waiting = 0;
-    return pth_cond_init(&c->cond);
+    c->cond = init;
+    return 0;
 }
 
 /* Pth conditions have a disturbing tendency to return when they're
@@ -238,14 +1006,13 @@ struct cwait_q {
 };
 
 struct cwait_th {
-    pth_t           th;
     struct cwait_th *next;
     int             done;
 };
 
 /* simulated pthread_cond_wait
  */
-int q3_cond_wait(q3_cond_t *c, pth_mutex_t *mutex)
+int q3_cond_wait(q3_cond_t *c, q3_mutex_t *mutex)
 {
     if (c->private == NULL)
 	c->private = calloc(sizeof(struct cwait_q), 1);
@@ -253,7 +1020,7 @@ int q3_cond_wait(q3_cond_t *c, pth_mutex_t *mutex)
     /* Queue self on the condition
      */
     struct cwait_q *q = c->private;
-    struct cwait_th self = {.th = pth_self(), .next = NULL, .done = 0};
+    struct cwait_th self = {.next = NULL, .done = 0};
     if (q->head) {
 	q->tail->next = &self;
 	q->tail = &self;
@@ -264,17 +1031,17 @@ int q3_cond_wait(q3_cond_t *c, pth_mutex_t *mutex)
     /* if we're the last thread runnable, wake the first thread in the
      * timer queue.
      */
-    pth_mutex_acquire(&wait_mutex, FALSE, NULL);
+    th_lock(&wait_mutex);
     if (--nthreads == 0)
         q3_wake_next(NULL);
-    pth_mutex_release(&wait_mutex);
+    th_unlock(&wait_mutex);
 
     /* And now wait until we're signalled.
      * (is c->waiting redundant now???)
      */
     c->waiting++;
     while (!self.done)
-	pth_cond_await(&c->cond, mutex, NULL);
+	th_wait(&c->cond, mutex);
     
     /* Note that c->waiting-- and nthreads++ happen in the call to
      * q3_signal / q3_broadcast that wakes us up. 
@@ -296,7 +1063,8 @@ int q3_cond_signal(q3_cond_t *c)
 	q->head = q->head->next;
     }
 
-    return pth_cond_notify(&c->cond, FALSE); /* broadcast=FALSE */
+    th_notify(&c->cond, 0);    /* one waiter */
+    return 0;
 }
 
 /* broadcast - mark all waiting threads as done and wake them.
@@ -314,7 +1082,8 @@ int q3_cond_broadcast(q3_cond_t *c)
 	}
     }
 
-    return pth_cond_notify(&c->cond, TRUE); /* broadcast=TRUE */
+    th_notify(&c->cond, 1);    /* all waiters */
+    return 0;
 }
 
 /* Thread creation. We use a thunk to track thread completion so that
@@ -336,32 +1105,177 @@ static void* run_thunk(void *ctx)
     return val;
 }
 
-int q3_create(pth_t *thread, pth_attr_t attr, 
-               void *(*start_routine)(void*), void *arg)
+int q3_create(q3_thread_t *thread, void *attr,
+              void *(*start_routine)(void*), void *arg)
 {
     struct q3_thunk *t = malloc(sizeof(*t));
     nthreads++;
     t->arg = arg;
     t->f = start_routine;
-    *thread = pth_spawn(attr, run_thunk, t);
+    *thread = th_spawn(attr, run_thunk, t);
     return 0;                   /* always succeeds */
 }
 
+int q3_join(q3_thread_t thread, void **val)
+{
+    void *v = th_join(thread);
+    if (val != NULL)
+        *val = v;
+    return 0;
+}
+
 void wait_until_done(void)
 {
     for (;;) {
         if (end_time > 0 && now > end_time)
             break;
-        if (done)
+        if (done || converged())
             break;
+        warm_branch();
         q3_usleep(1000000);
     }
 }
 
+/* Convergence (-converge relhw). Every counter and timer keeps an
+ * online batch-means record of its observations: each timer interval
+ * is one observation, and each counter contributes its time-average
+ * over every SEQ_WINDOW simulated seconds. Batches start at 5
+ * observations; when SEQ_BATCHES of them have been filled, adjacent
+ * pairs are merged, so memory stays fixed as the run grows.
+ *
+ * Fractions do the same with each event (1 for a hit, 0 otherwise).
+ *
+ * At checkpoints spaced geometrically in simulated time, the warm-up
+ * is found with MSER (the truncation point d minimising the variance
+ * of the remaining batches over (n-d)^2, for d up to n/2), the
+ * remaining batches are regrouped into SEQ_GROUPS batch means, and the
+ * run stops once every statistic's 95% confidence half-width is
+ * within relhw of its mean. The warm-up is then deleted: from there
+ * on stat_*_mean() return the mean of the remaining observations.
+ * (Histograms can't be truncated after the fact, so percentiles still
+ * cover the whole run.) end_time, if given, is still an upper bound.
+ */
+#define SEQ_BATCHES     256
+#define SEQ_FIRST_BATCH 5       /* MSER-5 */
+#define SEQ_GROUPS      20
+#define SEQ_WINDOW      1.0     /* secs per counter observation */
+#define SEQ_FIRST_CHECK 100.0
+#define SEQ_MAX_STATS   32
+
+struct seq_stat {
+    int    nb;                  /* batches filled */
+    long   bsize;               /* observations per batch */
+    long   n;                   /* observations in the current batch */
+    double sum;                 /* ... and their sum */
+    double b[SEQ_BATCHES];      /* batch means */
+    int    trunc;               /* batches deleted as warm-up */
+};
+
+double converge;                /* target relative half-width, 0=off */
+static double next_check = SEQ_FIRST_CHECK;
+static struct stat_count *seq_counters[SEQ_MAX_STATS];
+static struct stat_timer *seq_timers[SEQ_MAX_STATS];
+static int n_seq_counters, n_seq_timers;
+static int truncated;           /* converged, warm-up deleted */
+
+static void seq_add(struct seq_stat *q, double x)
+{
+    int i;
+    if (q->bsize == 0)
+        q->bsize = SEQ_FIRST_BATCH;
+    q->sum += x;
+    if (++q->n < q->bsize)
+        return;
+    q->b[q->nb++] = q->sum / q->n;
+    q->n = 0;
+    q->sum = 0;
+    if (q->nb == SEQ_BATCHES) {
+        for (i = 0; i < SEQ_BATCHES/2; i++)
+            q->b[i] = (q->b[2*i] + q->b[2*i+1]) / 2;
+        q->nb = SEQ_BATCHES/2;
+        q->bsize *= 2;
+    }
+}
+
+/* two-sided 95% Student t quantile for df degrees of freedom
+ */
+static double t95(int df)
+{
+    static double t[] = {0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447,
+                         2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160,
+                         2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                         2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052,
+                         2.048, 2.045, 2.042};
+    if (df < 31)
+        return t[df];
+    return 1.960 + 2.5 / df;    /* within .002 of the table above 30 */
+}
+
+/* Relative 95% half-width after MSER truncation, or INFINITY if
+ * there isn't enough data yet. q->trunc is set to the number of
+ * batches truncated.
+ */
+static double seq_relhw(struct seq_stat *q)
+{
+    int n = q->nb, d, best = 0, i, j, g;
+    double s1 = 0, s2 = 0, v, bestv = INFINITY;
+
+    /* suffix sums give MSER(d) for every d in one pass
+     */
+    for (d = n - 1; d >= 0; d--) {
+        s1 += q->b[d];
+        s2 += q->b[d] * q->b[d];
+        int k = n - d;
+        v = (s2 - s1 * s1 / k) / ((double)k * k);
+        if (d <= n/2 && v <= bestv) {
+            bestv = v;
+            best = d;
+        }
+    }
+    q->trunc = best;
+    if (n - best < SEQ_GROUPS)
+        return INFINITY;
+
+    /* regroup the last g*SEQ_GROUPS batches into SEQ_GROUPS means
+     */
+    g = (n - best) / SEQ_GROUPS;
+    double m[SEQ_GROUPS], mean = 0, var = 0;
+    for (i = 0; i < SEQ_GROUPS; i++) {
+        m[i] = 0;
+        for (j = 0; j < g; j++)
+            m[i] += q->b[n - (i+1)*g + j];
+        m[i] /= g;
+        mean += m[i];
+    }
+    mean /= SEQ_GROUPS;
+    for (i = 0; i < SEQ_GROUPS; i++)
+        var += (m[i] - mean) * (m[i] - mean);
+    var /= SEQ_GROUPS - 1;
+    if (mean == 0)
+        return var == 0 ? 0 : INFINITY;
+    return t95(SEQ_GROUPS - 1) * sqrt(var / SEQ_GROUPS) / fabs(mean);
+}
+
+/* mean of the observations left after deleting q->trunc batches,
+ * including the batch still being filled
+ */
+static double seq_mean(struct seq_stat *q)
+{
+    double sum = q->sum;
+    int i;
+    for (i = q->trunc; i < q->nb; i++)
+        sum += q->b[i] * q->bsize;
+    return sum / ((q->nb - q->trunc) * q->bsize + q->n);
+}
+
 struct stat_count {
+    double t0;                  /* start of measurement */
     double t;
     int count;
     double sum;
+    void *hist;                 /* see stat_count_attach() */
+    struct seq_stat seq;        /* see -converge */
+    double win_end, win_sum;    /* current observation window */
 };
 
 /* Create a new counter object. Free it using free()
@@ -369,13 +1283,29 @@ struct stat_count {
 void *stat_counter(void)
 {
     struct stat_count *sc = calloc(sizeof(*sc), 1);
+    sc->win_end = SEQ_WINDOW;
+    if (n_seq_counters < SEQ_MAX_STATS)
+        seq_counters[n_seq_counters++] = sc;
     return sc;
 }
 
 static void stat_count_change(void *ctr, int val)
 {
     struct stat_count *sc = ctr;
+    double t = sc->t;
     sc->sum += sc->count * (now - sc->t);
+    if (converge > 0) {
+        /* one observation per window - the time-average over it */
+        for (; now >= sc->win_end; sc->win_end += SEQ_WINDOW) {
+            sc->win_sum += sc->count * (sc->win_end - t);
+            seq_add(&sc->seq, sc->win_sum / SEQ_WINDOW);
+            sc->win_sum = 0;
+            t = sc->win_end;
+        }
+        sc->win_sum += sc->count * (now - t);
+    }
+    if (sc->hist != NULL)
+        stat_hist_record(sc->hist, sc->count, now - sc->t);
     sc->count += val;
     sc->t = now;
 }
@@ -394,23 +1324,30 @@ void stat_count_decr(void *ctr)
     stat_count_change(ctr, -1);
 }
 
-/* mean value of a counter from time 0 until now.
+/* mean value of a counter from time 0 (or the last stat_reset) until now.
  */
 double stat_count_mean(void *ctr)
 {
     struct stat_count *sc = ctr;
     double sum = sc->sum + sc->count * (now - sc->t);
-    return sum / now;
+    return truncated ? seq_mean(&sc->seq) : sum / (now - sc->t0);
+}
+
+/* Track the distribution of a counter's value over time. Each value
+ * is recorded, weighted by how long it was held, when the counter
+ * next changes.
+ */
+void stat_count_attach(void *ctr, void *hist)
+{
+    struct stat_count *sc = ctr;
+    sc->hist = hist;
 }
 
-#define TMR_MAX 20
 struct stat_timer {
-    struct {
-        pth_t thread;
-        double t;
-    } waiters[TMR_MAX];
     int count;
     double sum;
+    void *hist;                 /* see stat_timer_attach() */
+    struct seq_stat seq;        /* see -converge */
 };
 
 /* Create a new timer object. Free it using free()
@@ -418,61 +1355,519 @@ struct stat_timer {
 void *stat_timer(void)
 {
     struct stat_timer *st = calloc(sizeof(*st), 1);
+    if (n_seq_timers < SEQ_MAX_STATS)
+        seq_timers[n_seq_timers++] = st;
     return st;
 }
 
-/* Start a timer for the current thread.
+/* Start timing an interval. The handle returned is passed back to
+ * stat_timer_stop() when the interval ends - it carries the start
+ * time, so any number of intervals can be open at once.
  */
-void stat_timer_start(void *tmr)
+stat_tmr_t stat_timer_start(void *tmr)
 {
-    int i;
-    struct stat_timer *st = tmr;
-    for (i = 0; i < TMR_MAX; i++) 
-        if (st->waiters[i].thread == NULL)
-            break;
-    assert(i < TMR_MAX);
-    st->waiters[i].thread = pth_self();
-    st->waiters[i].t = now;
+    stat_tmr_t h = {.t = now};
+    return h;
 }
 
-/* Stop the timer for the current thread.
+/* Stop timing the interval started by handle h.
  */
-void stat_timer_stop(void *tmr)
+void stat_timer_stop(void *tmr, stat_tmr_t h)
 {
-    int i;
     struct stat_timer *st = tmr;
-    for (i = 0; i < TMR_MAX; i++) 
-        if (st->waiters[i].thread == pth_self())
-            break;
-    assert(i < TMR_MAX);
     st->count++;
-    st->sum += (now - st->waiters[i].t);
-    st->waiters[i].thread = NULL;
+    st->sum += (now - h.t);
+    if (st->hist != NULL)
+        stat_hist_record(st->hist, now - h.t, 1);
+    if (converge > 0)
+        seq_add(&st->seq, now - h.t);
+}
+
+/* Record every interval measured by a timer in a histogram as well.
+ */
+void stat_timer_attach(void *tmr, void *hist)
+{
+    struct stat_timer *st = tmr;
+    st->hist = hist;
 }
 
-/* Mean value - i.e. the average time between when a thread calls
- * timer_start() and when it calls timer_stop()
+/* Mean value - i.e. the average time between a call to timer_start()
+ * and the matching call to timer_stop()
  */
 double stat_timer_mean(void *tmr)
 {
     struct stat_timer *st = tmr;
+    if (truncated)
+        return seq_mean(&st->seq);
     return st->sum / st->count;
 }
 
+/* Fractions - how many of some set of events were 'hits'.
+ */
+struct stat_frac {
+    long n, hits;
+    struct seq_stat seq;        /* see -converge */
+};
+
+static struct stat_frac *fractions[SEQ_MAX_STATS];
+static int n_fractions;
+
+/* Create a new fraction object. Free it using free()
+ */
+void *stat_fraction(void)
+{
+    struct stat_frac *sf = calloc(sizeof(*sf), 1);
+    if (n_fractions < SEQ_MAX_STATS)
+        fractions[n_fractions++] = sf;
+    return sf;
+}
+
+/* count one event, which was a hit if 'hit' is true
+ */
+void stat_fraction_add(void *frac, int hit)
+{
+    struct stat_frac *sf = frac;
+    sf->n++;
+    sf->hits += (hit != 0);
+    if (converge > 0)
+        seq_add(&sf->seq, hit != 0);
+}
+
+double stat_fraction_mean(void *frac)
+{
+    struct stat_frac *sf = frac;
+    if (truncated)
+        return seq_mean(&sf->seq);
+    return sf->hits / (double) sf->n;
+}
+
+/* Throw away everything measured so far and measure from now on, e.g.
+ * after a warm-up. Applies to every counter, timer and fraction (and
+ * attached histograms); timer intervals still open count in full
+ * when they stop.
+ */
+void stat_reset(void)
+{
+    int i;
+    for (i = 0; i < n_seq_counters; i++) {
+        struct stat_count *sc = seq_counters[i];
+        sc->t0 = sc->t = now;
+        sc->sum = 0;
+        sc->win_end = now + SEQ_WINDOW;
+        sc->win_sum = 0;
+        memset(&sc->seq, 0, sizeof(sc->seq));
+        if (sc->hist != NULL)
+            stat_hist_clear(sc->hist);
+    }
+    for (i = 0; i < n_seq_timers; i++) {
+        struct stat_timer *st = seq_timers[i];
+        st->count = 0;
+        st->sum = 0;
+        memset(&st->seq, 0, sizeof(st->seq));
+        if (st->hist != NULL)
+            stat_hist_clear(st->hist);
+    }
+    for (i = 0; i < n_fractions; i++) {
+        fractions[i]->n = fractions[i]->hits = 0;
+        memset(&fractions[i]->seq, 0, sizeof(fractions[i]->seq));
+    }
+}
+
+/* Checkpoint: true if every tracked statistic - counter, timer and
+ * fraction - has converged. The warm-up is deleted from the means
+ * when it has; the longest one is printed, in simulated secs for the
+ * counters and in observations for timers and fractions.
+ */
+static int converged(void)
+{
+    int i;
+    long trunc, secs = 0, obs = 0;
+    double r, worst = 0;
+    struct seq_stat *q;
+
+    if (converge <= 0 || now < next_check)
+        return 0;
+    next_check = now * 1.25;
+
+    for (i = 0; i < n_seq_counters; i++) {
+        stat_count_change(seq_counters[i], 0); /* close out to now */
+        q = &seq_counters[i]->seq;
+        r = seq_relhw(q);
+        worst = r > worst ? r : worst;
+        trunc = q->trunc * q->bsize * SEQ_WINDOW;
+        secs = trunc > secs ? trunc : secs;
+    }
+    for (i = 0; i < n_seq_timers + n_fractions; i++) {
+        q = i < n_seq_timers ? &seq_timers[i]->seq
+                             : &fractions[i - n_seq_timers]->seq;
+        r = seq_relhw(q);
+        worst = r > worst ? r : worst;
+        trunc = q->trunc * q->bsize;
+        obs = trunc > obs ? trunc : obs;
+    }
+    if (worst > converge)
+        return 0;
+    truncated = 1;
+    printf("converged at %.0f: rel. half-width %.4f, warm-up %ld secs / "
+           "%ld obs deleted\n", now, worst, secs, obs);
+    return 1;
+}
+
+/* Replications. With -reps R each combination of the -chairs and
+ * -haircut values is run R times, in child processes spread over
+ * -jobs cores. Replication r uses seed+r, so replication 0 is the
+ * same as a plain run with that seed and every sweep point sees the
+ * same set of streams. Children report their results with
+ * stat_report() over a pipe; the parent prints the mean and a 95%
+ * confidence interval for each. See warm_branch() for -warmup.
+ */
+#define MAX_SWEEP 16
+#define MAX_STATS 16
+
+struct report {
+    char   name[40];
+    double value;
+};
+
+struct summary {
+    char   name[40];
+    int    n;
+    double sum, sumsq;
+    double *v;                  /* by replication, NaN if it failed */
+};
+
+static int report_fd = -1;
+
+/* Send one result to the parent. Does nothing outside of a replication.
+ */
+void stat_report(char *name, double value)
+{
+    struct report r;
+    if (report_fd < 0)
+        return;
+    memset(&r, 0, sizeof(r));
+    strncpy(r.name, name, sizeof(r.name) - 1);
+    r.value = value;
+    if (write(report_fd, &r, sizeof(r)) != sizeof(r))
+        perror("stat_report");
+}
+
+/* Sweep settings from the command line
+ */
+static int    reps, jobs, nchairs, nhaircut, chairs[MAX_SWEEP];
+static double haircut[MAX_SWEEP];
+static long   base_seed;
+static int    saved_stdout = -1; /* real stdout while warming up */
+
+/* add replication rep's result to a sweep point's summaries
+ */
+static void add_report(struct summary *sum, struct report *r, int rep)
+{
+    int i, j;
+    for (i = 0; i < MAX_STATS && sum[i].n > 0; i++)
+        if (!strcmp(sum[i].name, r->name))
+            break;
+    assert(i < MAX_STATS);
+    if (sum[i].v == NULL) {
+        sum[i].v = malloc(reps * sizeof(double));
+        for (j = 0; j < reps; j++)
+            sum[i].v[j] = NAN;
+    }
+    strcpy(sum[i].name, r->name);
+    sum[i].n++;
+    sum[i].sum += r->value;
+    sum[i].sumsq += r->value * r->value;
+    sum[i].v[rep] = r->value;
+}
+
+/* Variance reduction reports. An observation is one replication, or
+ * with -antithetic the mean of a pair. Comparing the variance of the
+ * observations with that of independent replications gives the number
+ * of independent replications needed for the same confidence interval,
+ * and so how many -crn or -antithetic saved.
+ */
+static int observations(double *v, double *o)
+{
+    int j, n = antithetic ? reps / 2 : reps;
+    for (j = 0; j < n; j++)
+        o[j] = antithetic ? (v[2*j] + v[2*j+1]) / 2 : v[j];
+    return n;
+}
+
+/* sample mean and variance of the x[] that aren't NaN, returns count
+ */
+static int mean_var(double *x, int n, double *mean, double *var)
+{
+    int i, k = 0;
+    double sum = 0, sumsq = 0;
+    for (i = 0; i < n; i++)
+        if (!isnan(x[i])) {
+            k++;
+            sum += x[i];
+            sumsq += x[i] * x[i];
+        }
+    *mean = k > 0 ? sum / k : 0;
+    *var = k > 1 ? (sumsq - k * *mean * *mean) / (k - 1) : 0;
+    if (*var < 0)
+        *var = 0;
+    return k;
+}
+
+/* print observations o[0..n) as mean +/- 95% CI, and the replications
+ * saved against independent ones with per-replication variance indep
+ */
+static void print_saved(char *name, double *o, int n, double indep)
+{
+    double mean, var, saved;
+    int k = mean_var(o, n, &mean, &var);
+    int used = antithetic ? 2 * k : k;
+    saved = var > 0 ? k * indep / var - used : INFINITY;
+    printf("  %-20s %8.4f +/- %.4f (n=%d%s, saved %.0f reps)\n", name, mean,
+           k > 1 ? t95(k - 1) * sqrt(var / k) : 0, k,
+           antithetic ? " pairs" : "", fabs(saved) < 0.5 ? 0 : saved);
+}
+
+/* with -crn, compare every sweep point against the first one
+ */
+static void print_crn(struct summary *sum, int npoints)
+{
+    double *a = calloc(reps, sizeof(double)), *b = calloc(reps, sizeof(double));
+    double mean, var_a, var_b;
+    int k, i, j, n;
+
+    printf("differences from chairs %d haircut %.2f (common random numbers):\n",
+           chairs[0], haircut[0]);
+    for (k = 1; k < npoints; k++) {
+        printf("chairs %d haircut %.2f:\n", chairs[k / nhaircut],
+               haircut[k % nhaircut]);
+        for (i = 0; i < MAX_STATS && sum[k*MAX_STATS + i].n > 0; i++) {
+            struct summary *s = &sum[k*MAX_STATS + i], *s0 = sum;
+            while (s0 < sum + MAX_STATS && s0->n > 0 && strcmp(s0->name, s->name))
+                s0++;
+            if (s0 == sum + MAX_STATS || s0->n == 0)
+                continue;
+            mean_var(s->v, reps, &mean, &var_a);
+            mean_var(s0->v, reps, &mean, &var_b);
+            n = observations(s->v, a);
+            observations(s0->v, b);
+            for (j = 0; j < n; j++)
+                a[j] -= b[j];
+            print_saved(s->name, a, n, var_a + var_b);
+        }
+    }
+    free(a);
+    free(b);
+}
+
+/* Set up job k in a freshly forked child: replication k % reps of
+ * sweep point k / reps.
+ */
+static void job_setup(int k, int fd)
+{
+    int point = k / reps, rep = k % reps;
+    report_fd = fd;
+    trace_fd = -1;
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        exit(1);
+    num_of_wait_chairs = chairs[point / nhaircut];
+    time_of_haircut = haircut[point % nhaircut];
+
+    /* after a warm-up, replication 0 just carries on with the warm-up
+     * stream. Antithetic pairs share a seed, the second run flipped. */
+    if (warmup > 0 && rep == 0 && !antithetic)
+        return;
+    long seed = antithetic ? base_seed + rep / 2 : base_seed + rep;
+    flip = antithetic && (rep & 1);
+    if (seed != 0)
+        rng_seed(seed);
+}
+
+/* Fork a child for every sweep point and replication, 'jobs' at a
+ * time, and summarise what they report. Returns the job number in the
+ * child, which should go on to run the simulation, and -1 in the
+ * parent once every child is done.
+ */
+static int fork_jobs(void)
+{
+    int npoints = nchairs * nhaircut, njobs = npoints * reps;
+    int job = 0, running = 0, failed = 0, i, k, status;
+    pid_t *pids = calloc(njobs, sizeof(pid_t));
+    int *fds = calloc(njobs, sizeof(int));
+    struct summary *sum = calloc(npoints * MAX_STATS, sizeof(*sum));
+    struct report r;
+
+    fflush(stdout);
+    while (job < njobs || running > 0) {
+        /* keep 'jobs' children running, then reap one */
+        if (job < njobs && running < jobs) {
+            int p[2];
+            if (pipe(p) < 0) {
+                perror("pipe");
+                exit(1);
+            }
+            if ((pids[job] = fork()) == 0) {
+                close(p[0]);
+                job_setup(job, p[1]);
+                free(pids);
+                free(fds);
+                free(sum);
+                return job;
+            }
+            close(p[1]);
+            fds[job++] = p[0];
+            running++;
+            continue;
+        }
+        pid_t pid = wait(&status);
+        if (pid < 0)
+            break;
+        for (k = 0; k < njobs && pids[k] != pid; k++)
+            ;
+        assert(k < njobs);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed++;
+        else
+            while (read(fds[k], &r, sizeof(r)) == sizeof(r))
+                add_report(&sum[(k / reps) * MAX_STATS], &r, k % reps);
+        close(fds[k]);
+        running--;
+    }
+
+    if (saved_stdout >= 0) {
+        fflush(stdout);
+        dup2(saved_stdout, 1);
+    }
+    if (warmup > 0)
+        printf("warm-up to %.0f shared by %d jobs\n", warmup, njobs);
+    if (warmup > 0 && reps > 1)
+        printf("(replications start from the same warmed-up state and are "
+               "not independent:\n the intervals below understate the "
+               "variance)\n");
+    for (k = 0; k < npoints; k++) {
+        printf("chairs %d haircut %.2f:\n", chairs[k / nhaircut],
+               haircut[k % nhaircut]);
+        for (i = 0; i < MAX_STATS && sum[k*MAX_STATS + i].n > 0; i++) {
+            struct summary *s = &sum[k*MAX_STATS + i];
+            double mean = s->sum / s->n, var = 0;
+            if (s->n > 1)
+                var = (s->sumsq - s->n * mean * mean) / (s->n - 1);
+            if (antithetic) {
+                double *o = calloc(reps, sizeof(double));
+                print_saved(s->name, o, observations(s->v, o),
+                            var > 0 ? var : 0);
+                free(o);
+                continue;
+            }
+            printf("  %-20s %8.4f +/- %.4f (n=%d)\n", s->name, mean,
+                   s->n > 1 ? t95(s->n - 1) * sqrt(var > 0 ? var : 0) / sqrt(s->n) : 0,
+                   s->n);
+        }
+    }
+    if (crn && npoints > 1)
+        print_crn(sum, npoints);
+    if (failed)
+        printf("%d replications failed\n", failed);
+
+    for (k = 0; k < npoints * MAX_STATS; k++)
+        free(sum[k].v);
+    free(pids);
+    free(fds);
+    free(sum);
+    return -1;
+}
+
+/* Warm start (-warmup W): the simulation runs once, with the default
+ * parameters, up to time W. At that point it forks the sweep, and each
+ * child switches to its own parameters and stream, throws away the
+ * statistics gathered so far and carries on from the warmed-up state,
+ * sharing it copy-on-write. Called from the simulation loops.
+ *
+ * Every replication branches from the same trajectory, so with -reps
+ * they are correlated and the confidence intervals come out too
+ * narrow; fork_jobs() says so. Use -warmup for comparing sweep points,
+ * and replications without it for intervals.
+ */
+static void warm_branch(void)
+{
+    if (warmup <= 0 || now < warmup || branched)
+        return;
+    branched = 1;
+    if (fork_jobs() < 0)
+        exit(0);
+    stat_reset();
+}
+
+/* parse a comma-separated list of numbers, returns the count
+ */
+static int parse_list(char *arg, double *vals)
+{
+    int n = 0;
+    char *p;
+    for (p = strtok(arg, ","); p != NULL && n < MAX_SWEEP; p = strtok(NULL, ","))
+        vals[n++] = atof(p);
+    return n;
+}
+
 #endif
 
 int main(int argc, char **argv)
 {
     int i, seed = 0;
+#ifdef Q3
+    double tmp[MAX_SWEEP];
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
     for (i = 1; i < argc && argv[i][0] == '-'; i++) {
 #ifdef Q2
         if (!strcmp(argv[i], "-speedup"))
             speedup = atof(argv[++i]);
 #endif
+#ifdef Q3
+        if (!strcmp(argv[i], "-reps"))
+            reps = atoi(argv[++i]);
+        if (!strcmp(argv[i], "-jobs"))
+            jobs = atoi(argv[++i]);
+        if (!strcmp(argv[i], "-chairs")) {
+            nchairs = parse_list(argv[++i], tmp);
+            for (int j = 0; j < nchairs; j++)
+                chairs[j] = tmp[j];
+        }
+        if (!strcmp(argv[i], "-haircut"))
+            nhaircut = parse_list(argv[++i], haircut);
+        if (!strcmp(argv[i], "-events"))
+            event_mode = 1;
+        if (!strcmp(argv[i], "-converge"))
+            converge = atof(argv[++i]);
+        if (!strcmp(argv[i], "-warmup"))
+            warmup = atof(argv[++i]);
+        if (!strcmp(argv[i], "-profile"))
+            profile = 1;
+        if (!strcmp(argv[i], "-antithetic"))
+            antithetic = 1;
+#endif
+        if (!strcmp(argv[i], "-customers"))
+            num_of_customers = atoi(argv[++i]);
         if (!strcmp(argv[i], "-seed"))
             seed = atoi(argv[++i]);
         if (!strcmp(argv[i], "-rand"))
             seed = time(NULL);
+        if (!strcmp(argv[i], "-trace"))
+            trace_open(argv[++i]);
+        if (!strcmp(argv[i], "-crn"))
+            crn = 1;
+        if (!strcmp(argv[i], "-rng")) {
+            i++;
+            if (i == argc || (strcmp(argv[i], "xoshiro") &&
+                              strcmp(argv[i], "drand48"))) {
+                fprintf(stderr, "-rng must be drand48 or xoshiro\n");
+                exit(1);
+            }
+            rng_xoshiro = !strcmp(argv[i], "xoshiro");
+        }
+        if (!strcmp(argv[i], "-decode")) {
+            trace_decode(argv[++i]);
+            exit(0);
+        }
     }
     if (i < argc)
         end_time = atoi(argv[i]);
@@ -484,19 +1879,60 @@ int main(int argc, char **argv)
         printf("duration %d\n", end_time);
 
     if (seed != 0)
-        srand48(seed);
+        rng_seed(seed);
 
 
 #ifdef Q3
-    pth_init();
+    if (reps > 0 || nchairs > 0 || nhaircut > 0 || warmup > 0) {
+        if (end_time <= 0 && converge <= 0) {
+            fprintf(stderr, "replications need a duration or -converge\n");
+            exit(1);
+        }
+        if (warmup > 0 && end_time > 0 && warmup >= end_time) {
+            fprintf(stderr, "warm-up must end before the duration\n");
+            exit(1);
+        }
+        if (nchairs == 0)
+            chairs[nchairs++] = num_of_wait_chairs;
+        if (nhaircut == 0)
+            haircut[nhaircut++] = time_of_haircut;
+        reps = reps > 0 ? reps : 1;
+        if (antithetic)
+            reps += reps & 1;   /* whole pairs */
+        jobs = jobs > 0 ? jobs : 1;
+        base_seed = seed;
+        if (warmup > 0) {
+            /* keep the warm-up quiet, fork_jobs() restores stdout */
+            fflush(stdout);
+            saved_stdout = dup(1);
+            if (freopen("/dev/null", "w", stdout) == NULL)
+                exit(1);
+        } else {
+            if (fork_jobs() < 0)
+                exit(0);
+            if (event_mode)
+                q3_events();
+            else
+                th_run_q3();
+            exit(0);
+        }
+    }
     signal(SIGINT, handler);
-    q3();
+    if (profile) {
+        prof.wall0 = wall_time();
+        atexit(prof_report);
+    }
+    if (event_mode)
+        q3_events();
+    else
+        th_run_q3();
 #endif
     
 #ifdef Q2
     signal(SIGINT, handler);
     init_time();
     q2();
+    late_report();
     exit(0);
 #endif
 
@@ -0,0 +1,358 @@
+/*
+ * file:        network.c
+ * description: Parallel simulation of a network of barber shops
+ *
+ * CS 5600, Computer Systems, Northeastern CCIS
+ *
+ * A closed population of customers wanders between S shops, each with
+ * one barber and a few waiting chairs - the Q3 model, replicated. A
+ * customer who finds a shop full, or who has had a haircut, walks to a
+ * random shop; the walk takes at least 'lookahead' secs plus an
+ * exponentially distributed amount.
+ *
+ * The shops are dealt out round-robin to worker threads, each with its
+ * own event heap. Workers run in YAWNS windows: after a barrier they
+ * agree on the earliest pending event time T, and each then runs its
+ * own events up to T + lookahead. Nothing can arrive from another shop
+ * inside the window, since any walk that starts at or after T ends at
+ * or after T + lookahead; such arrivals are put in the destination
+ * worker's inbox and picked up after the next barrier.
+ *
+ * Results don't depend on the number of threads. Every customer and
+ * every shop draws from its own random stream, and events are ordered
+ * by (time, customer, customer's event number), so each shop sees the
+ * same events in the same order however the shops are partitioned.
+ * -threads 1 is the sequential kernel.
+ *
+ * usage: network [-threads P] [-shops S] [-customers N] [-chairs C]
+ *                [-haircut H] [-walk MIN MEAN] [-seed N] duration
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+
+/* model parameters, from the command line
+ */
+static int    nshops = 16;
+static int    ncustomers = 160;
+static int    nchairs = 4;
+static double time_of_haircut = 1.2;
+static double walk_min = 0.5;           /* also the lookahead */
+static double walk_mean = 10;           /* exponential part of a walk */
+static double end_time;
+static int    nthreads = 1;
+static long   seed = 1;
+
+enum { EV_ARRIVE, EV_DONE };
+
+struct event {
+    double   t;
+    int      cust;
+    unsigned seq;               /* customer's event number, for ties */
+    int      shop;
+    int      what;              /* EV_ARRIVE or EV_DONE */
+};
+
+/* strict total order on events, so ties come out the same every run
+ */
+static int ev_before(struct event *a, struct event *b)
+{
+    if (a->t != b->t)
+        return a->t < b->t;
+    if (a->cust != b->cust)
+        return a->cust < b->cust;
+    return a->seq < b->seq;
+}
+
+struct customer {
+    unsigned short rng[3];      /* routing and walking times */
+    unsigned seq;               /* events created so far */
+    double   t_arrive;          /* when they sat down in the shop */
+};
+
+struct shop {
+    unsigned short rng[3];      /* haircut times */
+    int     *line;              /* ring buffer, nchairs + 1 long */
+    int      head, len;
+    double   t_start;           /* current haircut started */
+    /* statistics */
+    long     visits, turned_away, haircuts;
+    double   time_in_shop, busy;
+};
+
+struct worker {
+    struct event *heap;         /* binary min-heap, heap[0] first */
+    int      len, max;
+    struct event *inbox;        /* arrivals from other workers */
+    int      in_len, in_max;
+    pthread_mutex_t in_mutex;
+    long     events;
+};
+
+static struct customer *customers;
+static struct shop *shops;
+static struct worker *workers;
+static double *next_t;          /* each worker's earliest event */
+static long windows;
+static pthread_barrier_t barrier;
+
+#define OWNER(shop) ((shop) % nthreads)
+
+/* seed a drand48 stream from the run's seed and a stream number
+ */
+static void stream_seed(unsigned short *rng, long stream)
+{
+    uint64_t z = seed * 0x100000001B3ULL + stream + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    rng[0] = z & 0xFFFF;
+    rng[1] = (z >> 16) & 0xFFFF;
+    rng[2] = (z >> 32) & 0xFFFF;
+}
+
+static double exp_draw(unsigned short *rng, double T)
+{
+    return -1 * T * log(1 - erand48(rng));
+}
+
+/* Heap manipulation functions.
+ */
+static void heap_push(struct worker *w, struct event *e)
+{
+    int i, parent;
+    if (w->len == w->max) {
+        w->max = w->max ? 2 * w->max : 64;
+        w->heap = realloc(w->heap, w->max * sizeof(*w->heap));
+        assert(w->heap != NULL);
+    }
+    for (i = w->len++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (!ev_before(e, &w->heap[parent]))
+            break;
+        w->heap[i] = w->heap[parent];
+    }
+    w->heap[i] = *e;
+}
+static struct event heap_pop(struct worker *w)
+{
+    int i, child;
+    struct event top = w->heap[0], last = w->heap[--w->len];
+    for (i = 0; (child = 2*i + 1) < w->len; i = child) {
+        if (child + 1 < w->len && ev_before(&w->heap[child+1], &w->heap[child]))
+            child++;
+        if (!ev_before(&w->heap[child], &last))
+            break;
+        w->heap[i] = w->heap[child];
+    }
+    w->heap[i] = last;
+    return top;
+}
+
+/* Schedule an event for customer c. Events for shops on other workers
+ * go through the owner's inbox; they are always at least a lookahead
+ * away, so the owner won't need them until the next window.
+ */
+static void schedule(struct worker *self, double t, int c, int shop, int what)
+{
+    struct event e = {.t = t, .cust = c, .seq = customers[c].seq++,
+                      .shop = shop, .what = what};
+    struct worker *w = &workers[OWNER(shop)];
+    if (w == self) {
+        heap_push(w, &e);
+        return;
+    }
+    pthread_mutex_lock(&w->in_mutex);
+    if (w->in_len == w->in_max) {
+        w->in_max = w->in_max ? 2 * w->in_max : 64;
+        w->inbox = realloc(w->inbox, w->in_max * sizeof(*w->inbox));
+        assert(w->inbox != NULL);
+    }
+    w->inbox[w->in_len++] = e;
+    pthread_mutex_unlock(&w->in_mutex);
+}
+
+/* customer c leaves at time t and walks to a random shop
+ */
+static void walk(struct worker *self, double t, int c)
+{
+    struct customer *cu = &customers[c];
+    int next = erand48(cu->rng) * nshops;
+    double d = walk_min + exp_draw(cu->rng, walk_mean);
+    schedule(self, t + d, c, next, EV_ARRIVE);
+}
+
+static void start_haircut(struct worker *self, double t, struct shop *s, int shop)
+{
+    s->t_start = t;
+    schedule(self, t + exp_draw(s->rng, time_of_haircut),
+             s->line[s->head], shop, EV_DONE);
+}
+
+/* run one event at its shop
+ */
+static void run_event(struct worker *self, struct event *e)
+{
+    struct shop *s = &shops[e->shop];
+    int c = e->cust;
+
+    if (e->what == EV_ARRIVE) {
+        s->visits++;
+        if (s->len == nchairs + 1) {
+            s->turned_away++;
+            walk(self, e->t, c);
+            return;
+        }
+        customers[c].t_arrive = e->t;
+        s->line[(s->head + s->len++) % (nchairs + 1)] = c;
+        if (s->len == 1)
+            start_haircut(self, e->t, s, e->shop);
+    } else {
+        assert(s->line[s->head] == c);
+        s->head = (s->head + 1) % (nchairs + 1);
+        s->len--;
+        s->haircuts++;
+        s->busy += e->t - s->t_start;
+        s->time_in_shop += e->t - customers[c].t_arrive;
+        if (s->len > 0)
+            start_haircut(self, e->t, s, e->shop);
+        walk(self, e->t, c);
+    }
+}
+
+/* Worker loop - one YAWNS window per trip around.
+ */
+static void *worker_thread(void *arg)
+{
+    long id = (long)arg;
+    struct worker *self = &workers[id];
+    int i;
+
+    for (;;) {
+        /* everything sent during the last window is in by now */
+        for (i = 0; i < self->in_len; i++)
+            heap_push(self, &self->inbox[i]);
+        self->in_len = 0;
+        next_t[id] = self->len > 0 ? self->heap[0].t : INFINITY;
+        pthread_barrier_wait(&barrier);
+
+        double lbts = INFINITY;
+        for (i = 0; i < nthreads; i++)
+            if (next_t[i] < lbts)
+                lbts = next_t[i];
+        if (lbts >= end_time)
+            break;
+        double window = fmin(lbts + walk_min, end_time);
+        if (id == 0)
+            windows++;
+
+        while (self->len > 0 && self->heap[0].t < window) {
+            struct event e = heap_pop(self);
+            run_event(self, &e);
+            self->events++;
+        }
+        pthread_barrier_wait(&barrier);
+    }
+    return NULL;
+}
+
+static double wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1.0e9;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-threads"))
+            nthreads = atoi(argv[++i]);
+        if (!strcmp(argv[i], "-shops"))
+            nshops = atoi(argv[++i]);
+        if (!strcmp(argv[i], "-customers"))
+            ncustomers = atoi(argv[++i]);
+        if (!strcmp(argv[i], "-chairs"))
+            nchairs = atoi(argv[++i]);
+        if (!strcmp(argv[i], "-haircut"))
+            time_of_haircut = atof(argv[++i]);
+        if (!strcmp(argv[i], "-walk")) {
+            walk_min = atof(argv[++i]);
+            walk_mean = atof(argv[++i]);
+        }
+        if (!strcmp(argv[i], "-seed"))
+            seed = atol(argv[++i]);
+    }
+    if (i < argc)
+        end_time = atof(argv[i]);
+    if (end_time <= 0 || nthreads < 1 || nshops < 1 || walk_min <= 0) {
+        fprintf(stderr, "usage: %s [-threads P] [-shops S] [-customers N] "
+                "[-chairs C] [-haircut H] [-walk MIN MEAN] [-seed N] "
+                "duration\n(MIN must be > 0)\n", argv[0]);
+        exit(1);
+    }
+    if (nthreads > nshops)
+        nthreads = nshops;
+
+    customers = calloc(ncustomers, sizeof(*customers));
+    shops = calloc(nshops, sizeof(*shops));
+    workers = calloc(nthreads, sizeof(*workers));
+    next_t = calloc(nthreads, sizeof(*next_t));
+    for (i = 0; i < nthreads; i++)
+        pthread_mutex_init(&workers[i].in_mutex, NULL);
+    for (i = 0; i < nshops; i++) {
+        stream_seed(shops[i].rng, ncustomers + i);
+        shops[i].line = calloc(nchairs + 1, sizeof(int));
+    }
+
+    /* everyone starts out walking to their first shop; the events go
+     * into inboxes, and each worker picks them up on its first pass */
+    for (i = 0; i < ncustomers; i++) {
+        stream_seed(customers[i].rng, i);
+        walk(NULL, 0, i);
+    }
+
+    printf("network: %d shops, %d customers, %d threads, lookahead %.2f\n",
+           nshops, ncustomers, nthreads, walk_min);
+    printf("duration %.0f\n", end_time);
+
+    double t0 = wall_time();
+    pthread_t *th = calloc(nthreads, sizeof(*th));
+    pthread_barrier_init(&barrier, NULL, nthreads);
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&th[i], NULL, worker_thread, (void *)(long)i);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(th[i], NULL);
+    double wall = wall_time() - t0;
+
+    /* add up in shop order, so the totals don't depend on threads */
+    long visits = 0, away = 0, haircuts = 0, events = 0;
+    double in_shop = 0, busy = 0;
+    for (i = 0; i < nshops; i++) {
+        visits += shops[i].visits;
+        away += shops[i].turned_away;
+        haircuts += shops[i].haircuts;
+        in_shop += shops[i].time_in_shop;
+        busy += shops[i].busy;
+    }
+    for (i = 0; i < nthreads; i++)
+        events += workers[i].events;
+
+    printf("Fraction of customer visits result in turning away: %.4f\n",
+           visits ? (double)away / visits : 0);
+    printf("Average time spent in the shop: %.4f\n",
+           haircuts ? in_shop / haircuts : 0);
+    printf("Fraction of time the barbers are busy: %.4f\n",
+           busy / (nshops * end_time));
+    printf("Haircuts: %ld\n", haircuts);
+    fprintf(stderr, "%ld events, %ld windows, %.3f wall secs (%.0f events/sec)\n",
+            events, windows, wall, events / wall);
+    return 0;
+}
@@ -1,3 +1,3 @@
-gcc -g -Wall -o mirror-test mirror-test.c image.c homework.c && 
+gcc -g -Wall -o mirror-test mirror-test.c image.c homework.c parity.c -pthread && 
 ./mirror-test && 
 rm -rf mirror-test mirror-test.dSYM mirror1 mirror2 newdisk read-buffer write-buffer
\ No newline at end of file
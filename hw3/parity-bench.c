@@ -0,0 +1,135 @@
+/*
+ * file:        parity-bench.c
+ * description: throughput of each parity_xor version
+ *
+ * For every version this CPU supports, XORs K source buffers of
+ * LEN bytes into a destination over and over, and reports GB/s of
+ * source data. Each version is first checked against a plain byte
+ * loop (see check()).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "parity.h"
+
+#define LEN   (64 * 1024)
+#define MAXK  8
+#define BYTES (2L * 1024 * 1024 * 1024)  /* source bytes per measurement */
+#define PAD   64                /* room for misaligning buffers */
+
+static double wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1.0e9;
+}
+
+static struct parity_impl *find(const char *name)
+{
+    struct parity_impl *p;
+    for (p = parity_impls; p->name != NULL; p++)
+        if (!strcmp(p->name, name))
+            return p;
+    return NULL;
+}
+
+/* Compare p with a plain byte loop for K = 1..MAXK sources, lengths
+ * that hit every tail case, and sources and destination at different
+ * misalignments, including the destination used as srcs[0]. Bytes
+ * either side of the destination must be left alone. Returns 0 if
+ * all is well.
+ */
+static int check(struct parity_impl *p)
+{
+    static char src[MAXK][LEN + PAD], out[LEN + 2 * PAD], want[LEN];
+    int lens[] = {0, 1, 2, 3, 5, 7, 8, 15, 16, 17, 31, 32, 33, 63, 64, 65,
+                  127, 129, 255, 257, 511, 513, 1023, 4097, LEN - 1, LEN};
+    void *srcs[MAXK];
+    int i, j, k, l, off;
+
+    for (i = 0; i < MAXK; i++)
+        for (j = 0; j < LEN + PAD; j++)
+            src[i][j] = random();
+
+    for (k = 1; k <= MAXK; k++)
+        for (l = 0; l < sizeof(lens)/sizeof(lens[0]); l++)
+            for (off = 0; off < 16; off++) {
+                int len = lens[l], doff = PAD + (off * 5) % PAD;
+                int inplace = off == 15;
+
+                for (i = 0; i < k; i++)
+                    srcs[i] = src[i] + (off + 3 * i) % PAD;
+                memset(want, 0, len);
+                for (i = 0; i < k; i++)
+                    for (j = 0; j < len; j++)
+                        want[j] ^= ((char *)srcs[i])[j];
+
+                memset(out, 0x5a, sizeof(out));
+                if (inplace) {
+                    doff = PAD + 1;
+                    memcpy(out + doff, srcs[0], len);
+                    srcs[0] = out + doff;
+                }
+                p->xor(len, srcs, k, out + doff);
+
+                int bad = memcmp(want, out + doff, len) != 0;
+                for (j = 0; j < PAD && !bad; j++)
+                    bad = out[doff - PAD + j] != 0x5a ||
+                        (doff + len + j < sizeof(out) &&
+                         out[doff + len + j] != 0x5a);
+                if (bad) {
+                    printf("%s: wrong result, K=%d len=%d offset=%d%s\n",
+                           p->name, k, len, doff - PAD,
+                           inplace ? " in place" : "");
+                    return 1;
+                }
+            }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static char bufs[MAXK][LEN], dst[LEN];
+    void *srcs[MAXK];
+    int ks[] = {2, 4, 8}, i, j, k, failed = 0;
+    struct parity_impl *p;
+
+    srandom(1);
+    for (i = 0; i < MAXK; i++) {
+        for (j = 0; j < LEN; j++)
+            bufs[i][j] = random();
+        srcs[i] = bufs[i];
+    }
+
+    printf("parity_xor uses: %s\n", parity_name());
+    printf("%-8s", "version");
+    for (k = 0; k < sizeof(ks)/sizeof(ks[0]); k++)
+        printf("   K=%d GB/s", ks[k]);
+    printf("\n");
+
+    for (p = parity_impls; p->name != NULL; p++) {
+        if (!p->supported())
+            continue;
+        if (check(p)) {
+            failed = 1;
+            continue;
+        }
+        printf("%-8s", p->name);
+        for (k = 0; k < sizeof(ks)/sizeof(ks[0]); k++) {
+            int n = ks[k];
+            long reps = BYTES / ((long)n * LEN);
+            if (p == find("byte"))
+                reps /= 16;     /* very slow */
+            double t0 = wall_time();
+            for (i = 0; i < reps; i++)
+                p->xor(LEN, srcs, n, dst);
+            double t = wall_time() - t0;
+            printf("   %10.2f", reps * (double)n * LEN / t / 1e9);
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+    return failed;
+}
@@ -0,0 +1,3 @@
+gcc -g -O2 -Wall -o parity-bench parity-bench.c parity.c -pthread && 
+./parity-bench && 
+rm -rf parity-bench parity-bench.dSYM
@@ -0,0 +1,192 @@
+/*
+ * file:        parity.c
+ * description: XOR parity engine for the RAID 4 code in homework.c
+ *
+ * parity_xor() XORs any number of sources into a destination in one
+ * pass over memory, instead of one pass per source. Each version
+ * loads a chunk of every source into registers, XORs them there, and
+ * stores the chunk once. The SIMD versions are compiled with gcc
+ * 'target' attributes, so no special flags are needed, and are only
+ * called if CPUID says the CPU has the instructions.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "parity.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+/* Portable version, 64-bit words, and the tail end of every other
+ * version: XOR bytes [start, len).
+ */
+static void xor_words(int start, int len, char **s, int n, char *d)
+{
+    int i = start, k;
+    for (; i + 16 <= len; i += 16) {
+        uint64_t a, b, x, y;
+        memcpy(&a, s[0] + i, 8);
+        memcpy(&b, s[0] + i + 8, 8);
+        for (k = 1; k < n; k++) {
+            memcpy(&x, s[k] + i, 8);
+            memcpy(&y, s[k] + i + 8, 8);
+            a ^= x;
+            b ^= y;
+        }
+        memcpy(d + i, &a, 8);
+        memcpy(d + i + 8, &b, 8);
+    }
+    for (; i < len; i++) {
+        char c = s[0][i];
+        for (k = 1; k < n; k++)
+            c ^= s[k][i];
+        d[i] = c;
+    }
+}
+
+static void xor_word64(int len, void **srcs, int n, void *dst)
+{
+    xor_words(0, len, (char **) srcs, n, dst);
+}
+
+/* the original parity(): a byte at a time, one source pair per pass.
+ * Only here so parity-bench can compare against it.
+ */
+static void xor_byte(int len, void **srcs, int n, void *dst)
+{
+    unsigned char *d = dst;
+    int i, k, first = 0;
+    for (k = 0; k < n; k++)
+        if (srcs[k] == dst)
+            first = k;
+    if (srcs[first] != dst)
+        memcpy(d, srcs[first], len);
+    for (k = 0; k < n; k++) {
+        unsigned char *s = srcs[k];
+        if (k == first)
+            continue;
+        for (i = 0; i < len; i++)
+            d[i] = d[i] ^ s[i];
+    }
+}
+
+static int always(void)
+{
+    return 1;
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse2")))
+static void xor_sse2(int len, void **srcs, int n, void *dst)
+{
+    char **s = (char **) srcs, *d = dst;
+    int i = 0, k;
+    for (; i + 32 <= len; i += 32) {
+        __m128i a = _mm_loadu_si128((__m128i *) (s[0] + i));
+        __m128i b = _mm_loadu_si128((__m128i *) (s[0] + i + 16));
+        for (k = 1; k < n; k++) {
+            a = _mm_xor_si128(a, _mm_loadu_si128((__m128i *) (s[k] + i)));
+            b = _mm_xor_si128(b, _mm_loadu_si128((__m128i *) (s[k] + i + 16)));
+        }
+        _mm_storeu_si128((__m128i *) (d + i), a);
+        _mm_storeu_si128((__m128i *) (d + i + 16), b);
+    }
+    xor_words(i, len, s, n, d);
+}
+
+__attribute__((target("avx2")))
+static void xor_avx2(int len, void **srcs, int n, void *dst)
+{
+    char **s = (char **) srcs, *d = dst;
+    int i = 0, k;
+    for (; i + 64 <= len; i += 64) {
+        __m256i a = _mm256_loadu_si256((__m256i *) (s[0] + i));
+        __m256i b = _mm256_loadu_si256((__m256i *) (s[0] + i + 32));
+        for (k = 1; k < n; k++) {
+            a = _mm256_xor_si256(a, _mm256_loadu_si256((__m256i *) (s[k] + i)));
+            b = _mm256_xor_si256(b, _mm256_loadu_si256((__m256i *) (s[k] + i + 32)));
+        }
+        _mm256_storeu_si256((__m256i *) (d + i), a);
+        _mm256_storeu_si256((__m256i *) (d + i + 32), b);
+    }
+    xor_words(i, len, s, n, d);
+}
+
+__attribute__((target("avx512f")))
+static void xor_avx512(int len, void **srcs, int n, void *dst)
+{
+    char **s = (char **) srcs, *d = dst;
+    int i = 0, k;
+    for (; i + 128 <= len; i += 128) {
+        __m512i a = _mm512_loadu_si512(s[0] + i);
+        __m512i b = _mm512_loadu_si512(s[0] + i + 64);
+        for (k = 1; k < n; k++) {
+            a = _mm512_xor_si512(a, _mm512_loadu_si512(s[k] + i));
+            b = _mm512_xor_si512(b, _mm512_loadu_si512(s[k] + i + 64));
+        }
+        _mm512_storeu_si512(d + i, a);
+        _mm512_storeu_si512(d + i + 64, b);
+    }
+    xor_words(i, len, s, n, d);
+}
+
+static int has_sse2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+static int has_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+static int has_avx512(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+struct parity_impl parity_impls[] = {
+#ifdef HAVE_X86
+    {"avx512", has_avx512, xor_avx512},
+    {"avx2",   has_avx2,   xor_avx2},
+    {"sse2",   has_sse2,   xor_sse2},
+#endif
+    {"word64", always,     xor_word64},
+    {"byte",   always,     xor_byte},
+    {NULL, NULL, NULL}
+};
+
+/* picked once, by whichever thread gets here first - the RAID code
+ * calls parity_xor() from its I/O threads
+ */
+static struct parity_impl *chosen;
+static pthread_once_t      chosen_once = PTHREAD_ONCE_INIT;
+
+static void choose(void)
+{
+    struct parity_impl *p;
+    for (p = parity_impls; !p->supported(); p++)
+        ;
+    chosen = p;
+}
+
+void parity_xor(int len, void **srcs, int nsrcs, void *dst)
+{
+    if (nsrcs <= 0) {
+        memset(dst, 0, len);
+        return;
+    }
+    pthread_once(&chosen_once, choose);
+    chosen->xor(len, srcs, nsrcs, dst);
+}
+
+const char *parity_name(void)
+{
+    pthread_once(&chosen_once, choose);
+    return chosen->name;
+}
@@ -0,0 +1,28 @@
+/*
+ * file:        parity.h
+ * description: XOR parity engine for the RAID 4 code in homework.c
+ */
+#ifndef __PARITY_H__
+#define __PARITY_H__
+
+/* XOR 'nsrcs' buffers of 'len' bytes into 'dst' in a single pass:
+ *   dst = srcs[0] ^ srcs[1] ^ ... ^ srcs[nsrcs-1]
+ * 'dst' may be one of the sources. The fastest version this CPU
+ * supports is picked on the first call.
+ */
+extern void parity_xor(int len, void **srcs, int nsrcs, void *dst);
+
+/* The versions of parity_xor, fastest first, ending with a NULL name.
+ * Mostly for parity-bench.c.
+ */
+struct parity_impl {
+    const char *name;
+    int  (*supported)(void);
+    void (*xor)(int len, void **srcs, int nsrcs, void *dst);
+};
+extern struct parity_impl parity_impls[];
+
+/* name of the version parity_xor uses */
+extern const char *parity_name(void);
+
+#endif
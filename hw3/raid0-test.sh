@@ -1,3 +1,3 @@
-gcc -g -Wall -o raid0-test raid0-test.c image.c homework.c && 
+gcc -g -Wall -o raid0-test raid0-test.c image.c homework.c parity.c -pthread && 
 ./raid0-test && 
 rm -rf raid0-test raid0-test.dSYM image[0-9]*
\ No newline at end of file
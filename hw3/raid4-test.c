@@ -42,6 +42,42 @@ void dump(char* buffer, int length, char* path){
     fclose(output);
 }
 
+/* Write n blocks of new random data at first_blk, keeping a copy in backup */
+void write_tracked(struct blkdev *raid4, int first_blk, int n, char *backup){
+    char buf[BLOCK_SIZE * n];
+    for (int i = 0; i < BLOCK_SIZE * n; i++){
+        buf[i] = (char) rand();
+    }
+    assert(blkdev_write(raid4, first_blk, n, buf) == SUCCESS);
+    memcpy(backup + first_blk * BLOCK_SIZE, buf, BLOCK_SIZE * n);
+}
+
+/* Read the whole volume back and compare it with backup */
+void check_volume(struct blkdev *raid4, int nblks, char *backup){
+    char copy[BLOCK_SIZE * nblks];
+    assert(blkdev_read(raid4, 0, nblks, copy) == SUCCESS);
+    assert(memcmp(backup, copy, BLOCK_SIZE * nblks) == 0);
+}
+
+/* Check parity on the disks themselves: at every block offset of the
+ * volume, the blocks of all the disks must XOR to zero.
+ */
+void check_parity(struct blkdev *disks[], int ndisk, int nblks){
+    char blk[BLOCK_SIZE], sum[BLOCK_SIZE];
+    for (int b = 0; b < nblks / (ndisk - 1); b++){
+        bzero(sum, BLOCK_SIZE);
+        for (int k = 0; k < ndisk; k++){
+            assert(blkdev_read(disks[k], b, 1, blk) == SUCCESS);
+            for (int i = 0; i < BLOCK_SIZE; i++){
+                sum[i] ^= blk[i];
+            }
+        }
+        for (int i = 0; i < BLOCK_SIZE; i++){
+            assert(sum[i] == 0);
+        }
+    }
+}
+
 int main() {
     // Passes all other tests with different strip sizes (e.g. 2, 4, 7, and 32 sectors) 
     // and different numbers of disks.
@@ -100,16 +136,40 @@ int main() {
             assert(blkdev_read(raid4, 0, nblks, image_copy) == SUCCESS);
             assert(memcpy(backup, image_copy, BLOCK_SIZE * nblks));
 
+            // each way of writing a row keeps the parity right: a full
+            // row, most of a row (reconstruct-write), one block
+            // (read-modify-write), and a write across several rows
+            int row = unit * (ndisk - 1);
+            write_tracked(raid4, 0, row, backup);
+            if (nblks >= 2 * row) {
+                write_tracked(raid4, row + 1, row - 1, backup);
+            }
+            write_tracked(raid4, row / 2, 1, backup);
+            write_tracked(raid4, row / 2 + 1, nblks - row / 2 - 2, backup);
+            check_parity(disks, ndisk, nblks);
+            check_volume(raid4, nblks, backup);
+
             // fail a disk and verify that the volume doesn't fail.
             image_fail(disks[0]);
             assert(blkdev_write(raid4, unit - 1, 2, write_buf) == SUCCESS);
+            memcpy(backup + (unit - 1) * BLOCK_SIZE, write_buf, BLOCK_SIZE * 2);
             assert(blkdev_read(raid4, unit - 1, 2, read_buf) == SUCCESS);
             assert(memcmp(write_buf, read_buf, BLOCK_SIZE * 2) == 0);
             bzero(read_buf, BLOCK_SIZE * 2);
 
+            // degraded: a full row and single blocks on and off the
+            // failed disk, then everything reads back through parity
+            write_tracked(raid4, nblks - row, row, backup);
+            write_tracked(raid4, 0, 1, backup);
+            write_tracked(raid4, unit, 1, backup);
+            check_volume(raid4, nblks, backup);
+
             // test replace
             struct blkdev *newdisk = create_new_image("newdisk", BLK_NUM);
             assert(raid4_replace(raid4, 0, newdisk) == SUCCESS);
+            disks[0] = newdisk;
+            check_parity(disks, ndisk, nblks);
+            check_volume(raid4, nblks, backup);
             for (int k = 0; k < TESTS_NUM; k++) {
                 int first_blk = rand() % nblks - 1;
                 if (first_blk < 0) continue;
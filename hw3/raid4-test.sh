@@ -1,3 +1,3 @@
-gcc -g -Wall -o raid4-test raid4-test.c image.c homework.c && 
+gcc -g -Wall -o raid4-test raid4-test.c image.c homework.c parity.c -pthread && 
 ./raid4-test && 
 rm -rf raid4-test raid4-test.dSYM newdisk image[0-9]*
\ No newline at end of file